@@ -0,0 +1,163 @@
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "splittree.h"
+#include "fftrepulsion.h"
+
+using namespace std::chrono;
+typedef std::chrono::high_resolution_clock Clock;
+typedef std::chrono::duration<float> dsec;
+
+// Benchmark of the repulsive force approximations (point-cell Barnes-Hut, dual-tree, FFT) on a synthetic
+// 2D map shaped like a t-SNE embedding: many Gaussian clusters of different sizes.
+// All three are timed and checked against the exact forces and Q sums of a random sample of points.
+
+static int _argc;
+static const char **_argv;
+
+int getOptionInt(const char *option_name, int default_value) {
+    for (int i = _argc - 2; i >= 0; i -= 2)
+        if (strcmp(_argv[i], option_name) == 0) return atoi(_argv[i + 1]);
+    return default_value;
+}
+
+float getOptionFloat(const char *option_name, float default_value) {
+    for (int i = _argc - 2; i >= 0; i -= 2)
+        if (strcmp(_argv[i], option_name) == 0) return (float)atof(_argv[i + 1]);
+    return default_value;
+}
+
+// Relative error of the repulsive force (x and y planes of stride floats) and of the Q sum of the
+// sampled points, found at rows sample_f of neg_f and sample_Q of Q
+void reportError(const char* name, const std::vector<double>& exact_f, const std::vector<double>& exact_Q,
+                 const std::vector<int>& sample_f, const std::vector<int>& sample_Q,
+                 const float* neg_f, int stride, const float* Q) {
+    double err_f = .0, norm_f = .0, err_Q = .0, norm_Q = .0;
+    for (size_t s = 0; s < sample_f.size(); s++) {
+        for (int d = 0; d < 2; d++) {
+            double t = neg_f[d * stride + sample_f[s]] - exact_f[s * 2 + d];
+            err_f += t * t;
+            norm_f += exact_f[s * 2 + d] * exact_f[s * 2 + d];
+        }
+        err_Q += fabs(Q[sample_Q[s]] - exact_Q[s]);
+        norm_Q += exact_Q[s];
+    }
+    printf("%-12s force error %.2e, Q error %.2e\n", name, sqrt(err_f / norm_f), err_Q / norm_Q);
+}
+
+int main(int argc, const char *argv[]) {
+  _argc = argc - 1;
+  _argv = argv + 1;
+
+  const int N = getOptionInt("-N", 1000000);
+  const float theta = getOptionFloat("-t", 0.5f);
+  const int numThreads = getOptionInt("-n", 1);
+  const int reps = getOptionInt("-k", 3);
+  const int numSamples = getOptionInt("-s", 200);
+
+#ifdef _OPENMP
+  omp_set_num_threads(numThreads);
+#endif
+
+  // Clustered map
+  std::mt19937 gen(15618);
+  std::normal_distribution<float> normal(0.f, 1.f);
+  std::uniform_real_distribution<float> uniform(-50.f, 50.f);
+  const int numClusters = 100;
+  std::vector<float> cluster(numClusters * 3);
+  for (int c = 0; c < numClusters; c++) {
+    cluster[c * 3] = uniform(gen);
+    cluster[c * 3 + 1] = uniform(gen);
+    cluster[c * 3 + 2] = 0.5f + fabsf(normal(gen));
+  }
+  // The map and the forces are stored as an x plane and a y plane, as in TSNE
+  const int B = SplitTree<2>::QT_BATCH_SIZE;
+  int N_padded = (N + B - 1) / B * B;
+  std::vector<float> Y(N_padded * 2, .0f);
+  float* Y_x = &Y[0];
+  float* Y_y = &Y[N_padded];
+  for (int i = 0; i < N; i++) {
+    int c = gen() % numClusters;
+    Y_x[i] = cluster[c * 3] + cluster[c * 3 + 2] * normal(gen);
+    Y_y[i] = cluster[c * 3 + 1] + cluster[c * 3 + 2] * normal(gen);
+  }
+  std::vector<float> neg_f(N_padded * 2), Q(N_padded);
+
+  auto build_start = Clock::now();
+  SplitTree<2> tree(&Y[0], N_padded, N, 2);
+  printf("N = %d, theta = %.2f, %d threads; tree build %.4f s\n", N, theta, numThreads,
+         duration_cast<dsec>(Clock::now() - build_start).count());
+  const int* order = tree.pointOrder();
+
+  // Exact forces of a sample of positions in tree order
+  std::vector<int> sample(numSamples);
+  std::vector<double> exact_f(numSamples * 2, .0), exact_Q(numSamples, .0);
+  for (int s = 0; s < numSamples; s++) {
+    sample[s] = gen() % N;
+    int i = order[sample[s]];
+    for (int j = 0; j < N; j++) {
+      if (j == i) continue;
+      double dx = Y_x[i] - Y_x[j], dy = Y_y[i] - Y_y[j];
+      double q = 1. / (1. + dx * dx + dy * dy);
+      exact_Q[s] += q;
+      exact_f[s * 2] += q * q * dx;
+      exact_f[s * 2 + 1] += q * q * dy;
+    }
+  }
+
+  // Point-cell Barnes-Hut, as in TSNE::computeNonEdgeForces
+  float bh_time = FLT_MAX;
+  for (int r = 0; r < reps; r++) {
+    auto start = Clock::now();
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 16)
+#endif
+    for (int b = 0; b < N_padded / B; b++) {
+      int first = b * B;
+      for (int d = 0; d < 2; d++) {
+        std::fill(neg_f.begin() + d * N_padded + first, neg_f.begin() + d * N_padded + first + B, .0f);
+      }
+      std::fill(Q.begin() + first, Q.begin() + first + B, .0f);
+      tree.computeNonEdgeForces(order + first, std::min(B, N - first), theta, &neg_f[first], N_padded, &Q[first]);
+    }
+    bh_time = std::min(bh_time, duration_cast<dsec>(Clock::now() - start).count());
+  }
+  printf("Barnes-Hut   %.4f s\n", bh_time);
+  reportError("Barnes-Hut", exact_f, exact_Q, sample, sample, &neg_f[0], N_padded, &Q[0]);
+
+  float dual_time = FLT_MAX;
+  for (int r = 0; r < reps; r++) {
+    auto start = Clock::now();
+    tree.computeDualTreeForces(theta, &neg_f[0], N_padded, &Q[0]);
+    dual_time = std::min(dual_time, duration_cast<dsec>(Clock::now() - start).count());
+  }
+  printf("dual-tree    %.4f s (%.2fx)\n", dual_time, bh_time / dual_time);
+  // The dual-tree forces are in point order (and Q in tree order); the sample is mapped back from tree order
+  std::vector<int> point_sample(numSamples);
+  for (int s = 0; s < numSamples; s++) point_sample[s] = order[sample[s]];
+  reportError("dual-tree", exact_f, exact_Q, point_sample, sample, &neg_f[0], N_padded, &Q[0]);
+
+  // FFT interpolation works in point order
+  FFTRepulsion fft;
+  float fft_time = FLT_MAX;
+  for (int r = 0; r < reps; r++) {
+    auto start = Clock::now();
+    fft.computeNonEdgeForces(&Y[0], N_padded, N, &neg_f[0], &Q[0]);
+    fft_time = std::min(fft_time, duration_cast<dsec>(Clock::now() - start).count());
+  }
+  printf("FFT          %.4f s (%.2fx)\n", fft_time, bh_time / fft_time);
+  reportError("FFT", exact_f, exact_Q, point_sample, point_sample, &neg_f[0], N_padded, &Q[0]);
+
+  return 0;
+}
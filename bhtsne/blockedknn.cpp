@@ -0,0 +1,433 @@
+#include <cfloat>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "blockedknn.h"
+#include "inputfile.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLOCKEDKNN_X86
+#include <immintrin.h>
+#endif
+
+
+// Query rows per tile (in groups of TILE_ROWS), reference rows per tile (in strips of STRIP), and dimensions
+// per pass over a tile, for which a strip of the panel (32 KB) stays in L1
+static const int QUERY_BLOCK = 96;
+static const int REFERENCE_BLOCK = 256;
+static const int DEPTH_BLOCK = 128;
+static const int TILE_ROWS = 6;
+static const int STRIP = 64;
+
+/*
+    Add the dot products of TILE_ROWS query rows (q[i] points to row i at the first dimension of the pass)
+    with the STRIP columns of a strip (depth rows of STRIP floats, one per dimension, 64-byte aligned) to
+    the rows of tile (TILE_ROWS rows, REFERENCE_BLOCK floats apart, 64-byte aligned).
+*/
+typedef void (*TileKernel)(const float* const* q, const float* strip, int depth, float* tile);
+
+
+static void tileScalar(const float* const* q, const float* strip, int depth, float* tile)
+{
+    for (int i = 0; i < TILE_ROWS; i++) {
+        float* out = tile + i * REFERENCE_BLOCK;
+        for (int d = 0; d < depth; d++) {
+            float x = q[i][d];
+            const float* p = strip + d * STRIP;
+            for (int c = 0; c < STRIP; c++) {
+                out[c] += x * p[c];
+            }
+        }
+    }
+}
+
+
+#ifdef BLOCKEDKNN_X86
+
+// Columns in blocks of 16, the TILE_ROWS x 16 products held in registers over the whole pass (12 of the
+// 16 registers; a panel row is then loaded once for six broadcasts)
+__attribute__((target("avx2,fma")))
+static void tileAVX2(const float* const* q, const float* strip, int depth, float* tile)
+{
+    for (int c = 0; c < STRIP; c += 16) {
+        __m256 acc[TILE_ROWS][2];
+        for (int i = 0; i < TILE_ROWS; i++) {
+            acc[i][0] = _mm256_load_ps(tile + i * REFERENCE_BLOCK + c);
+            acc[i][1] = _mm256_load_ps(tile + i * REFERENCE_BLOCK + c + 8);
+        }
+        for (int d = 0; d < depth; d++) {
+            __m256 p0 = _mm256_load_ps(strip + d * STRIP + c);
+            __m256 p1 = _mm256_load_ps(strip + d * STRIP + c + 8);
+            for (int i = 0; i < TILE_ROWS; i++) {
+                __m256 x = _mm256_broadcast_ss(q[i] + d);
+                acc[i][0] = _mm256_fmadd_ps(x, p0, acc[i][0]);
+                acc[i][1] = _mm256_fmadd_ps(x, p1, acc[i][1]);
+            }
+        }
+        for (int i = 0; i < TILE_ROWS; i++) {
+            _mm256_store_ps(tile + i * REFERENCE_BLOCK + c, acc[i][0]);
+            _mm256_store_ps(tile + i * REFERENCE_BLOCK + c + 8, acc[i][1]);
+        }
+    }
+}
+
+
+// As tileAVX2, with all STRIP columns at once (24 of the 32 registers)
+__attribute__((target("avx512f")))
+static void tileAVX512(const float* const* q, const float* strip, int depth, float* tile)
+{
+    __m512 acc[TILE_ROWS][4];
+    for (int i = 0; i < TILE_ROWS; i++) {
+        for (int j = 0; j < 4; j++) {
+            acc[i][j] = _mm512_load_ps(tile + i * REFERENCE_BLOCK + 16 * j);
+        }
+    }
+    for (int d = 0; d < depth; d++) {
+        __m512 p0 = _mm512_load_ps(strip + d * STRIP);
+        __m512 p1 = _mm512_load_ps(strip + d * STRIP + 16);
+        __m512 p2 = _mm512_load_ps(strip + d * STRIP + 32);
+        __m512 p3 = _mm512_load_ps(strip + d * STRIP + 48);
+        for (int i = 0; i < TILE_ROWS; i++) {
+            __m512 x = _mm512_set1_ps(q[i][d]);
+            acc[i][0] = _mm512_fmadd_ps(x, p0, acc[i][0]);
+            acc[i][1] = _mm512_fmadd_ps(x, p1, acc[i][1]);
+            acc[i][2] = _mm512_fmadd_ps(x, p2, acc[i][2]);
+            acc[i][3] = _mm512_fmadd_ps(x, p3, acc[i][3]);
+        }
+    }
+    for (int i = 0; i < TILE_ROWS; i++) {
+        for (int j = 0; j < 4; j++) {
+            _mm512_store_ps(tile + i * REFERENCE_BLOCK + 16 * j, acc[i][j]);
+        }
+    }
+}
+
+#endif
+
+
+static TileKernel selectTileKernel()
+{
+#ifdef BLOCKEDKNN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return tileAVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return tileAVX2;
+#endif
+    return tileScalar;
+}
+
+
+static float* allocateAligned(size_t count)
+{
+    void* ptr;
+    if (posix_memalign(&ptr, 64, count * sizeof(float)) != 0) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+    return (float*) ptr;
+}
+
+
+static inline float squaredNorm(const float* x, int D)
+{
+    float sum = .0;
+    for (int d = 0; d < D; d++) {
+        sum += x[d] * x[d];
+    }
+    return sum;
+}
+
+static inline float squaredDistance(const float* x, const float* y, int D)
+{
+    float dist = .0;
+#ifdef _OPENMP
+    #pragma omp simd reduction(+:dist)
+#endif
+    for (int d = 0; d < D; d++) {
+        float t = x[d] - y[d];
+        dist += t * t;
+    }
+    return dist;
+}
+
+
+// Candidate neighbour of a query: its distance by the expansion, its index, and its distance computed
+// directly (only filled in when the reference rows are gone by the end of the search)
+struct Candidate
+{
+    float dist;
+    int index;
+    float exact;
+
+    bool operator< (const Candidate& other) const {
+        return dist < other.dist || (dist == other.dist && index < other.index);
+    }
+};
+
+// Candidates of a query: up to 2K below threshold, cut back to the closest K whenever full, which then
+// lowers threshold to the K-th distance (amortized constant time per candidate, where a heap would sift)
+static inline void addCandidate(Candidate* candidates, int& count, float& threshold, int K, const Candidate& candidate)
+{
+    candidates[count++] = candidate;
+    if (count == 2 * K) {
+        std::nth_element(candidates, candidates + (K - 1), candidates + count);
+        count = K;
+        threshold = candidates[K - 1].dist;
+    }
+}
+
+
+// Transpose count rows (count <= REFERENCE_BLOCK) into a panel of strips of D rows of STRIP floats (zero
+// past count), and set their squared norms
+static void packPanel(const float* rows, int count, int D, float* panel, float* norms)
+{
+    for (int c = 0; c < REFERENCE_BLOCK; c++) {
+        float* strip = panel + (size_t) (c / STRIP) * D * STRIP;
+        for (int d = 0; d < D; d++) {
+            strip[d * STRIP + c % STRIP] = c < count ? rows[(size_t) c * D + d] : .0;
+        }
+        if (c < count) norms[c] = squaredNorm(rows + (size_t) c * D, D);
+    }
+}
+
+
+/*
+    Compare count query rows (count <= QUERY_BLOCK, points q_first, ... with squared norms q_norms) with
+    the columns reference rows of a panel (points r_first, ... with squared norms r_norms), adding the
+    closer ones to the candidates of the queries (2K per query). With r_rows, the reference rows
+    themselves, candidates get their distance computed directly as they are added.
+*/
+static void searchPanel(TileKernel kernel, const float* q_rows, const float* q_norms, int q_first, int count,
+                        const float* panel, const float* r_norms, int r_first, int columns, const float* r_rows,
+                        int D, int K, float* tile, Candidate* candidates, int* num_candidates, float* threshold)
+{
+    std::fill(tile, tile + QUERY_BLOCK * REFERENCE_BLOCK, .0f);
+    for (int d0 = 0; d0 < D; d0 += DEPTH_BLOCK) {
+        int depth = std::min(DEPTH_BLOCK, D - d0);
+        for (int c = 0; c < REFERENCE_BLOCK; c += STRIP) {
+            const float* strip = panel + (size_t) (c / STRIP) * D * STRIP + (size_t) d0 * STRIP;
+            for (int i = 0; i < count; i += TILE_ROWS) {
+                // (a short last group repeats its last row)
+                const float* q[TILE_ROWS];
+                for (int j = 0; j < TILE_ROWS; j++) {
+                    q[j] = q_rows + (size_t) std::min(i + j, count - 1) * D + d0;
+                }
+                kernel(q, strip, depth, tile + i * REFERENCE_BLOCK + c);
+            }
+        }
+    }
+
+    // Keep the closest references of every query: the distances of a row are computed in place, and only
+    // groups of 16 with one below the threshold of the query are looked at
+    for (int i = 0; i < count; i++) {
+        int n = q_first + i;
+        Candidate* query_candidates = candidates + i * 2 * K;
+        float* dist = tile + i * REFERENCE_BLOCK;
+        float query_norm = q_norms[i];
+        for (int c0 = 0; c0 < columns; c0 += 16) {
+            int c1 = std::min(c0 + 16, columns);
+            float group_min = FLT_MAX;
+#ifdef _OPENMP
+            #pragma omp simd reduction(min:group_min)
+#endif
+            for (int c = c0; c < c1; c++) {
+                dist[c] = query_norm + r_norms[c] - 2 * dist[c];
+                group_min = std::min(group_min, dist[c]);
+            }
+            if (group_min >= threshold[i]) continue;
+            for (int c = c0; c < c1; c++) {
+                if (dist[c] < threshold[i] && r_first + c != n) {
+                    Candidate candidate = { dist[c], r_first + c, .0f };
+                    if (r_rows != NULL) {
+                        candidate.exact = squaredDistance(q_rows + (size_t) i * D, r_rows + (size_t) c * D, D);
+                    }
+                    addCandidate(query_candidates, num_candidates[i], threshold[i], K, candidate);
+                }
+            }
+        }
+    }
+}
+
+
+// The closest K of the count candidates of query x, with their distances computed directly (from the
+// rows of X, or given when X is NULL), in increasing order
+static void finishQuery(Candidate* list, int count, int K, const float* x, const float* X, int D,
+                        int* indices, float* distances)
+{
+    std::nth_element(list, list + (K - 1), list + count);
+    for (int k = 0; k < K; k++) {
+        list[k].dist = X != NULL ? squaredDistance(x, X + (size_t) list[k].index * D, D) : list[k].exact;
+    }
+    std::sort(list, list + K);
+    for (int k = 0; k < K; k++) {
+        distances[k] = list[k].dist;
+        indices[k] = list[k].index;
+    }
+}
+
+
+void blockedKnn(const float* X, int N, int D, int K, int* indices, float* distances)
+{
+    TileKernel kernel = selectTileKernel();
+
+    // Reference rows by block, transposed into panels
+    int num_blocks = (N + REFERENCE_BLOCK - 1) / REFERENCE_BLOCK;
+    size_t panel_size = (size_t) D * REFERENCE_BLOCK;
+    float* panels = allocateAligned(num_blocks * panel_size);
+    float* norms = (float*) malloc(num_blocks * REFERENCE_BLOCK * sizeof(float));
+    if (norms == NULL) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int b = 0; b < num_blocks; b++) {
+        int first = b * REFERENCE_BLOCK;
+        packPanel(X + (size_t) first * D, std::min(REFERENCE_BLOCK, N - first), D, panels + b * panel_size, norms + first);
+    }
+
+    int num_query_blocks = (N + QUERY_BLOCK - 1) / QUERY_BLOCK;
+#ifdef _OPENMP
+    #pragma omp parallel
+#endif
+    {
+        float* tile = allocateAligned(QUERY_BLOCK * REFERENCE_BLOCK);
+        std::vector<Candidate> candidates(QUERY_BLOCK * 2 * K);
+        std::vector<int> num_candidates(QUERY_BLOCK);
+        std::vector<float> threshold(QUERY_BLOCK);
+
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 1)
+#endif
+        for (int qb = 0; qb < num_query_blocks; qb++) {
+            int first = qb * QUERY_BLOCK;
+            int count = std::min(QUERY_BLOCK, N - first);
+            std::fill(num_candidates.begin(), num_candidates.end(), 0);
+            std::fill(threshold.begin(), threshold.end(), FLT_MAX);
+            for (int b = 0; b < num_blocks; b++) {
+                searchPanel(kernel, X + (size_t) first * D, norms + first, first, count,
+                            panels + b * panel_size, norms + b * REFERENCE_BLOCK, b * REFERENCE_BLOCK,
+                            std::min(REFERENCE_BLOCK, N - b * REFERENCE_BLOCK), NULL,
+                            D, K, tile, &candidates[0], &num_candidates[0], &threshold[0]);
+            }
+            for (int i = 0; i < count; i++) {
+                int n = first + i;
+                finishQuery(&candidates[i * 2 * K], num_candidates[i], K, X + (size_t) n * D, X, D,
+                            indices + (size_t) n * K, distances + (size_t) n * K);
+            }
+        }
+        free(tile);
+    }
+
+    free(panels);
+    free(norms);
+}
+
+
+void blockedKnn(const InputFile& input, int K, size_t buffer_size, int* indices, float* distances, int verbose)
+{
+    TileKernel kernel = selectTileKernel();
+    int N = input.rows();
+    int D = input.dims();
+
+    // A quarter of the buffer for the reference rows (read, and packed), the rest for the query rows and
+    // their candidates: the file is read once per chunk of queries
+    size_t reference_bytes = (2 * (size_t) D + 1) * sizeof(float);
+    size_t query_bytes = (size_t) D * sizeof(float) + sizeof(float) + 2 * K * sizeof(Candidate) + sizeof(int) + sizeof(float);
+    int max_rows = (N + REFERENCE_BLOCK - 1) / REFERENCE_BLOCK * REFERENCE_BLOCK;
+    int reference_rows = (int) std::min<size_t>(max_rows, buffer_size / 4 / reference_bytes / REFERENCE_BLOCK * REFERENCE_BLOCK);
+    int query_rows = (int) std::min<size_t>(max_rows, (buffer_size - buffer_size / 4) / query_bytes / QUERY_BLOCK * QUERY_BLOCK);
+    reference_rows = std::max(reference_rows, REFERENCE_BLOCK);
+    query_rows = std::max(query_rows, QUERY_BLOCK);
+    if (verbose)
+        fprintf(stderr, " - streaming %d query rows against %d reference rows at a time\n", query_rows, reference_rows);
+
+    int num_blocks = reference_rows / REFERENCE_BLOCK;
+    size_t panel_size = (size_t) D * REFERENCE_BLOCK;
+    float* queries = (float*) malloc((size_t) query_rows * D * sizeof(float));
+    float* query_norms = (float*) malloc(query_rows * sizeof(float));
+    float* references = (float*) malloc((size_t) reference_rows * D * sizeof(float));
+    float* reference_norms = (float*) malloc(reference_rows * sizeof(float));
+    float* panels = allocateAligned(num_blocks * panel_size);
+    std::vector<Candidate> candidates((size_t) query_rows * 2 * K);
+    std::vector<int> num_candidates(query_rows);
+    std::vector<float> threshold(query_rows);
+    if (queries == NULL || query_norms == NULL || references == NULL || reference_norms == NULL) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+
+    for (int q_first = 0; q_first < N; q_first += query_rows) {
+        int q_count = std::min(query_rows, N - q_first);
+        int num_query_blocks = (q_count + QUERY_BLOCK - 1) / QUERY_BLOCK;
+        input.read(q_first, q_count, queries);
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (int i = 0; i < q_count; i++) {
+            query_norms[i] = squaredNorm(queries + (size_t) i * D, D);
+        }
+        std::fill(num_candidates.begin(), num_candidates.end(), 0);
+        std::fill(threshold.begin(), threshold.end(), FLT_MAX);
+
+        for (int r_first = 0; r_first < N; r_first += reference_rows) {
+            int r_count = std::min(reference_rows, N - r_first);
+            int r_blocks = (r_count + REFERENCE_BLOCK - 1) / REFERENCE_BLOCK;
+            input.read(r_first, r_count, references);
+#ifdef _OPENMP
+            #pragma omp parallel for
+#endif
+            for (int b = 0; b < r_blocks; b++) {
+                int first = b * REFERENCE_BLOCK;
+                packPanel(references + (size_t) first * D, std::min(REFERENCE_BLOCK, r_count - first), D,
+                          panels + b * panel_size, reference_norms + first);
+            }
+
+#ifdef _OPENMP
+            #pragma omp parallel
+#endif
+            {
+                float* tile = allocateAligned(QUERY_BLOCK * REFERENCE_BLOCK);
+#ifdef _OPENMP
+                #pragma omp for schedule(dynamic, 1)
+#endif
+                for (int qb = 0; qb < num_query_blocks; qb++) {
+                    int first = qb * QUERY_BLOCK;
+                    int count = std::min(QUERY_BLOCK, q_count - first);
+                    for (int b = 0; b < r_blocks; b++) {
+                        int block_first = b * REFERENCE_BLOCK;
+                        searchPanel(kernel, queries + (size_t) first * D, query_norms + first, q_first + first, count,
+                                    panels + b * panel_size, reference_norms + block_first, r_first + block_first,
+                                    std::min(REFERENCE_BLOCK, r_count - block_first), references + (size_t) block_first * D,
+                                    D, K, tile, &candidates[(size_t) first * 2 * K], &num_candidates[first], &threshold[first]);
+                    }
+                }
+                free(tile);
+            }
+        }
+
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (int i = 0; i < q_count; i++) {
+            size_t n = q_first + i;
+            finishQuery(&candidates[(size_t) i * 2 * K], num_candidates[i], K, NULL, NULL, D, indices + n * K, distances + n * K);
+        }
+        if (verbose)
+            fprintf(stderr, " - point %d of %d\n", q_first + q_count, N);
+    }
+
+    free(queries);
+    free(query_norms);
+    free(references);
+    free(reference_norms);
+    free(panels);
+}
+
+
+// The VP tree prunes less and less as the dimension grows, while the cost of the blocked search is fixed
+// at N^2 D multiply-adds: it is preferred from BLOCKED_MIN_DIMS dimensions, up to BLOCKED_MAX_WORK of them
+static const int BLOCKED_MIN_DIMS = 64;
+static const double BLOCKED_MAX_WORK = 4e12;
+
+bool preferBlockedKnn(int N, int D)
+{
+    return D >= BLOCKED_MIN_DIMS && (double) N * N * D <= BLOCKED_MAX_WORK;
+}
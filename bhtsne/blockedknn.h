@@ -0,0 +1,36 @@
+/*
+ *  blockedknn.h
+ *  Header file for the exact nearest neighbours of the input points by blocked brute force.
+ */
+
+#include <stddef.h>
+
+#ifndef BLOCKEDKNN_H
+#define BLOCKEDKNN_H
+
+class InputFile;
+
+/*
+    Exact K nearest neighbours of all rows of an [N, D] matrix (excluding the row itself), under the
+    squared Euclidean distance, by comparing all pairs: |x|^2 + |y|^2 - 2 x.y, with the dot products
+    computed a tile of query rows against a tile of reference rows at a time, as in a matrix product.
+    Every query keeps a heap of its K best while the reference tiles go by, so no N x N matrix is ever
+    formed. The distances of the K found are computed again directly, as the expansion loses precision
+    for close points.
+
+    Writes the neighbours sorted by increasing distance: indices[n * K + k] and the squared distances
+    distances[n * K + k]. K must be below N. The result does not depend on the number of threads.
+*/
+void blockedKnn(const float* X, int N, int D, int K, int* indices, float* distances);
+
+/*
+    The same search over points read from a file, within about buffer_size bytes: a chunk of query rows
+    stays in memory while chunks of reference rows are read in turn, so the file is read once per chunk
+    of queries. Gives the same result as blockedKnn over the rows in memory.
+*/
+void blockedKnn(const InputFile& input, int K, size_t buffer_size, int* indices, float* distances, int verbose = 0);
+
+// Whether blockedKnn is expected to beat the VP tree for N points of D dimensions
+bool preferBlockedKnn(int N, int D);
+
+#endif
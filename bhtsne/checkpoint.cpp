@@ -0,0 +1,126 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "checkpoint.h"
+#include "csrfile.h"
+
+
+static const char SIMILARITIES_MAGIC[8] = { 'T', 'S', 'N', 'E', '-', 'P', 'C', '1' };
+static const char STATE_MAGIC[8] = { 'T', 'S', 'N', 'E', '-', 'S', 'C', '1' };
+
+
+Checkpoint::Checkpoint(const char* path) : file(path), failed(false), mapping(NULL), mapping_size(0) {}
+
+Checkpoint::~Checkpoint()
+{
+    wait();
+    if (mapping != NULL) {
+        munmap(mapping, mapping_size);
+    }
+}
+
+
+void Checkpoint::saveSimilarities(int N, const int64_t* row_P, const int* col_P, const float* val_P, float perplexity)
+{
+    if (writer.joinable()) writer.join();
+    writer = std::thread(&Checkpoint::writeSimilarities, this, N, row_P, col_P, val_P, perplexity);
+}
+
+void Checkpoint::writeSimilarities(int N, const int64_t* row_P, const int* col_P, const float* val_P, float perplexity)
+{
+    Similarities extra;
+    memset(&extra, 0, sizeof(extra));
+    extra.perplexity = perplexity;
+    if (!writeCsrFile(file + ".P", SIMILARITIES_MAGIC, &extra, sizeof(extra), N, row_P, col_P, val_P)) failed = true;
+}
+
+
+// The copy is the only part of a checkpoint the optimization waits for (besides a write still going)
+void Checkpoint::saveState(const State& state, const float* mean, const float* Y, const float* uY, const float* gains, int stride)
+{
+    if (writer.joinable()) writer.join();
+    const int N = (int) state.N;
+    const int no_dims = state.no_dims;
+    snapshot.resize(no_dims + (size_t) 3 * no_dims * N);
+    float* out = &snapshot[0];
+    memcpy(out, mean, no_dims * sizeof(float));
+    const float* planes[3] = { Y, uY, gains };
+    for (int a = 0; a < 3; a++) {
+        for (int d = 0; d < no_dims; d++) {
+            float* plane = out + no_dims + ((size_t) a * no_dims + d) * N;
+            const float* source = planes[a] + (size_t) d * stride;
+#ifdef _OPENMP
+            #pragma omp parallel for
+#endif
+            for (int n = 0; n < N; n++) {
+                plane[n] = source[n];
+            }
+        }
+    }
+    writer = std::thread(&Checkpoint::writeState, this, state);
+}
+
+void Checkpoint::writeState(State state)
+{
+    StateHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STATE_MAGIC, sizeof(STATE_MAGIC));
+    header.state = state;
+    const void* parts[2] = { &header, &snapshot[0] };
+    size_t sizes[2] = { sizeof(header), snapshot.size() * sizeof(float) };
+    if (!writeFileAtomically(file, parts, sizes, 2)) failed = true;
+}
+
+
+bool Checkpoint::wait()
+{
+    if (writer.joinable()) writer.join();
+    bool ok = !failed;
+    failed = false;
+    return ok;
+}
+
+
+bool Checkpoint::loadSimilarities(int* N, int64_t** row_P, int** col_P, float** val_P, float* perplexity)
+{
+    size_t size;
+    const void* extra;
+    void* ptr = mapCsrFile(file + ".P", SIMILARITIES_MAGIC, sizeof(Similarities), &size, N, &extra, row_P, col_P, val_P);
+    if (ptr == NULL) return false;
+
+    if (mapping != NULL) munmap(mapping, mapping_size);
+    mapping = ptr;
+    mapping_size = size;
+    Similarities similarities;
+    memcpy(&similarities, extra, sizeof(similarities));
+    *perplexity = similarities.perplexity;
+    return true;
+}
+
+
+bool Checkpoint::loadState(int N, int no_dims, State* state, float* mean, float* Y, float* uY, float* gains, int stride)
+{
+    FILE* h = fopen(file.c_str(), "rb");
+    if (h == NULL) return false;
+    StateHeader header;
+    bool valid = fread(&header, sizeof(header), 1, h) == 1 &&
+                 memcmp(header.magic, STATE_MAGIC, sizeof(STATE_MAGIC)) == 0 &&
+                 header.state.N == N && header.state.no_dims == no_dims &&
+                 fread(mean, sizeof(float), no_dims, h) == (size_t) no_dims;
+    float* planes[3] = { Y, uY, gains };
+    for (int a = 0; a < 3 && valid; a++) {
+        for (int d = 0; d < no_dims && valid; d++) {
+            valid = fread(planes[a] + (size_t) d * stride, sizeof(float), N, h) == (size_t) N;
+        }
+    }
+    valid = valid && fgetc(h) == EOF;
+    fclose(h);
+    if (valid) *state = header.state;
+    return valid;
+}
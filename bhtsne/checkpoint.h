@@ -0,0 +1,97 @@
+/*
+ *  checkpoint.h
+ *  Header file for the on-disk checkpoints of an optimization.
+ */
+
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+
+/*
+    Checkpoint of an optimization (TSNE::optimize), from which it resumes to the map it would have
+    reached without stopping, bit for bit: with any number of threads for Barnes-Hut and FFT repulsion,
+    whose maps do not depend on it, and with the same number as before for the dual-tree. Two files:
+        path + ".P" -- the input similarities P: a CSR file (see csrfile.h) with the perplexity as its
+                       extra header bytes. Written once, as P does not change.
+        path        -- the optimizer state: a StateHeader, then the mean subtracted by the next update
+                       (no_dims floats), and the map, its updates and its gains (no_dims planes of N
+                       floats each). Replaced at every checkpoint.
+    Files are written to a temporary name first, so that a file under its final name is always complete.
+
+    Writes are asynchronous: the save functions copy what changes and return, and one thread writes the
+    files in the order they were saved, while the optimization goes on. A save waits for the write before
+    it (so the state is copied once at a time), and the destructor for all of them.
+*/
+class Checkpoint
+{
+public:
+    // The schedule of an optimization, where it stands, and the P it runs on
+    struct State
+    {
+        int64_t N;
+        int64_t nnz;                // row_P[N]
+        int no_dims;
+        int iter;                   // the next iteration to run
+        int stop_lying_iter;
+        int mom_switch_iter;
+        int repulsion;
+        float theta;
+        float learning_rate;
+        float exaggeration;         // current values
+        float momentum;
+        float final_momentum;
+    };
+
+    Checkpoint(const char* path);
+    ~Checkpoint();
+
+    // Start writing P (it must not change or be freed until the write is done)
+    void saveSimilarities(int N, const int64_t* row_P, const int* col_P, const float* val_P, float perplexity);
+    // Start writing the state: the mean, and the no_dims planes of the map, updates and gains, stride
+    // floats apart
+    void saveState(const State& state, const float* mean, const float* Y, const float* uY, const float* gains, int stride);
+    // Wait for the writes; false if any failed since the last call
+    bool wait();
+
+    // Point the arrays at the saved P (they stay valid until the checkpoint is destroyed, and must not be
+    // freed or written to)
+    bool loadSimilarities(int* N, int64_t** row_P, int** col_P, float** val_P, float* perplexity);
+    // Read the state into the mean and planes, if it is one of N points in no_dims dimensions
+    bool loadState(int N, int no_dims, State* state, float* mean, float* Y, float* uY, float* gains, int stride);
+
+    const char* path() const { return file.c_str(); }
+
+private:
+    // Extra header bytes of the P file
+    struct Similarities
+    {
+        float perplexity;
+        int padding;
+    };
+
+    struct StateHeader
+    {
+        char magic[8];
+        State state;
+    };
+
+    std::string file;
+    std::thread writer;
+    bool failed;
+    std::vector<float> snapshot;    // the state being written
+    void* mapping;
+    size_t mapping_size;
+
+    void writeSimilarities(int N, const int64_t* row_P, const int* col_P, const float* val_P, float perplexity);
+    void writeState(State state);
+
+    Checkpoint(const Checkpoint&);
+    Checkpoint& operator= (const Checkpoint&);
+};
+
+#endif
@@ -0,0 +1,80 @@
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "csrfile.h"
+
+
+bool writeFileAtomically(const std::string& file, const void* const* parts, const size_t* sizes, int count)
+{
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".tmp%ld", (long) getpid());
+    std::string temporary = file + suffix;
+    FILE* h = fopen(temporary.c_str(), "wb");
+    if (h == NULL) return false;
+    bool written = true;
+    for (int i = 0; i < count && written; i++) {
+        written = sizes[i] == 0 || fwrite(parts[i], sizes[i], 1, h) == 1;
+    }
+    written = fclose(h) == 0 && written;
+    if (!written || rename(temporary.c_str(), file.c_str()) != 0) {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+bool writeCsrFile(const std::string& file, const char* magic, const void* extra, size_t extra_size,
+                  int N, const int64_t* row_P, const int* col_P, const float* val_P)
+{
+    CsrHeader header;
+    memcpy(header.magic, magic, sizeof(header.magic));
+    header.N = N;
+    header.nnz = row_P[N];
+    const void* parts[5] = { &header, extra, row_P, col_P, val_P };
+    size_t sizes[5] = { sizeof(header), extra_size, (N + 1) * sizeof(int64_t),
+                        header.nnz * sizeof(int), header.nnz * sizeof(float) };
+    return writeFileAtomically(file, parts, sizes, 5);
+}
+
+
+void* mapCsrFile(const std::string& file, const char* magic, size_t extra_size, size_t* mapping_size,
+                 int* N, const void** extra, int64_t** row_P, int** col_P, float** val_P)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(CsrHeader) + extra_size) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = st.st_size;
+    void* ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) return NULL;
+
+    // Check the magic, and that the file is complete
+    const CsrHeader* header = (const CsrHeader*) ptr;
+    char* body = (char*) ptr + sizeof(CsrHeader) + extra_size;
+    int64_t* rows = (int64_t*) body;
+    bool valid = memcmp(header->magic, magic, sizeof(header->magic)) == 0 && header->N > 0 && header->N < INT32_MAX &&
+                 header->nnz >= 0 && size == sizeof(CsrHeader) + extra_size + (header->N + 1) * sizeof(int64_t) +
+                                             header->nnz * (sizeof(int) + sizeof(float)) &&
+                 rows[header->N] == header->nnz;
+    if (!valid) {
+        munmap(ptr, size);
+        return NULL;
+    }
+
+    *mapping_size = size;
+    *N = (int) header->N;
+    *extra = (char*) ptr + sizeof(CsrHeader);
+    *row_P = rows;
+    *col_P = (int*) (rows + header->N + 1);
+    *val_P = (float*) (*col_P + header->nnz);
+    return ptr;
+}
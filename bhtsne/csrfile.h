@@ -0,0 +1,39 @@
+/*
+ *  csrfile.h
+ *  Header file for the files of a CSR matrix, as the similarity cache and the checkpoints store P.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#ifndef CSRFILE_H
+#define CSRFILE_H
+
+
+/*
+    File layout: a CsrHeader, extra_size bytes of the format (its key or parameters), then row_P (N + 1
+    64-bit offsets), col_P and val_P (row_P[N] ints and floats). extra_size keeps row_P 8-byte aligned
+    if it is a multiple of 8.
+*/
+struct CsrHeader
+{
+    char magic[8];
+    int64_t N;
+    int64_t nnz;
+};
+
+// Write count parts one after the other to file, through a temporary name first, so that a file under
+// its final name is always complete
+bool writeFileAtomically(const std::string& file, const void* const* parts, const size_t* sizes, int count);
+
+// Write a CSR file (atomically)
+bool writeCsrFile(const std::string& file, const char* magic, const void* extra, size_t extra_size,
+                  int N, const int64_t* row_P, const int* col_P, const float* val_P);
+
+// Map a CSR file read-only, if it has the magic and is complete, and point extra and the arrays into the
+// mapping (to be unmapped with munmap(mapping, *mapping_size)); returns the mapping, or NULL
+void* mapCsrFile(const std::string& file, const char* magic, size_t extra_size, size_t* mapping_size,
+                 int* N, const void** extra, int64_t** row_P, int** col_P, float** val_P);
+
+#endif
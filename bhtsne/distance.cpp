@@ -0,0 +1,136 @@
+#include "distance.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DISTANCE_X86
+#include <immintrin.h>
+#endif
+
+
+// Blocks of DISTANCE_PADDING floats, testing the bound after each
+static float distanceScalar(const float* x1, const float* x2, int D, float bound)
+{
+    float dd = .0;
+    for (int d0 = 0; d0 < D; d0 += DISTANCE_PADDING) {
+        for (int d = d0; d < d0 + DISTANCE_PADDING; d++) {
+            float t = x1[d] - x2[d];
+            dd += t * t;
+        }
+        if (dd > bound) break;
+    }
+    return dd;
+}
+
+
+#ifdef DISTANCE_X86
+
+__attribute__((target("avx2")))
+static inline float horizontalSum(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+
+// Four accumulators over blocks of 32 floats, testing the bound after each block; the partial sums are
+// reduced the same way at every test and at the end, so a result is never below an earlier partial sum
+__attribute__((target("avx2,fma")))
+static float distanceAVX2(const float* x1, const float* x2, int D, float bound)
+{
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+    int d = 0;
+    for (; d + 32 <= D; d += 32) {
+        __m256 t0 = _mm256_sub_ps(_mm256_load_ps(x1 + d), _mm256_load_ps(x2 + d));
+        __m256 t1 = _mm256_sub_ps(_mm256_load_ps(x1 + d + 8), _mm256_load_ps(x2 + d + 8));
+        __m256 t2 = _mm256_sub_ps(_mm256_load_ps(x1 + d + 16), _mm256_load_ps(x2 + d + 16));
+        __m256 t3 = _mm256_sub_ps(_mm256_load_ps(x1 + d + 24), _mm256_load_ps(x2 + d + 24));
+        acc0 = _mm256_fmadd_ps(t0, t0, acc0);
+        acc1 = _mm256_fmadd_ps(t1, t1, acc1);
+        acc2 = _mm256_fmadd_ps(t2, t2, acc2);
+        acc3 = _mm256_fmadd_ps(t3, t3, acc3);
+        float dd = horizontalSum(_mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+        if (dd > bound) return dd;
+    }
+    if (d < D) {
+        __m256 t0 = _mm256_sub_ps(_mm256_load_ps(x1 + d), _mm256_load_ps(x2 + d));
+        __m256 t1 = _mm256_sub_ps(_mm256_load_ps(x1 + d + 8), _mm256_load_ps(x2 + d + 8));
+        acc0 = _mm256_fmadd_ps(t0, t0, acc0);
+        acc1 = _mm256_fmadd_ps(t1, t1, acc1);
+    }
+    return horizontalSum(_mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+}
+
+
+__attribute__((target("avx512f")))
+static inline float horizontalSum(__m512 v)
+{
+    // (masked extracts with a defined source, as the plain ones trip -Wmaybe-uninitialized in GCC)
+    __m512d v_d = _mm512_castps_pd(v);
+    __m256 lo = _mm256_castpd_ps(_mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), (__mmask8) 0xF, v_d, 0));
+    __m256 hi = _mm256_castpd_ps(_mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), (__mmask8) 0xF, v_d, 1));
+    return horizontalSum(_mm256_add_ps(lo, hi));
+}
+
+
+// As distanceAVX2, over blocks of 64 floats
+__attribute__((target("avx512f")))
+static float distanceAVX512(const float* x1, const float* x2, int D, float bound)
+{
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    __m512 acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+    int d = 0;
+    for (; d + 64 <= D; d += 64) {
+        __m512 t0 = _mm512_sub_ps(_mm512_load_ps(x1 + d), _mm512_load_ps(x2 + d));
+        __m512 t1 = _mm512_sub_ps(_mm512_load_ps(x1 + d + 16), _mm512_load_ps(x2 + d + 16));
+        __m512 t2 = _mm512_sub_ps(_mm512_load_ps(x1 + d + 32), _mm512_load_ps(x2 + d + 32));
+        __m512 t3 = _mm512_sub_ps(_mm512_load_ps(x1 + d + 48), _mm512_load_ps(x2 + d + 48));
+        acc0 = _mm512_fmadd_ps(t0, t0, acc0);
+        acc1 = _mm512_fmadd_ps(t1, t1, acc1);
+        acc2 = _mm512_fmadd_ps(t2, t2, acc2);
+        acc3 = _mm512_fmadd_ps(t3, t3, acc3);
+        float dd = horizontalSum(_mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3)));
+        if (dd > bound) return dd;
+    }
+    // Up to three blocks of 16 floats are left
+    if (d < D) {
+        __m512 t = _mm512_sub_ps(_mm512_load_ps(x1 + d), _mm512_load_ps(x2 + d));
+        acc0 = _mm512_fmadd_ps(t, t, acc0);
+        d += 16;
+    }
+    if (d < D) {
+        __m512 t = _mm512_sub_ps(_mm512_load_ps(x1 + d), _mm512_load_ps(x2 + d));
+        acc1 = _mm512_fmadd_ps(t, t, acc1);
+        d += 16;
+    }
+    if (d < D) {
+        __m512 t = _mm512_sub_ps(_mm512_load_ps(x1 + d), _mm512_load_ps(x2 + d));
+        acc2 = _mm512_fmadd_ps(t, t, acc2);
+    }
+    return horizontalSum(_mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3)));
+}
+
+#endif
+
+
+DistanceKernel selectDistanceKernel(const char** name)
+{
+    const char* kernel_name = "scalar";
+    DistanceKernel kernel = distanceScalar;
+#ifdef DISTANCE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        kernel_name = "AVX-512";
+        kernel = distanceAVX512;
+    }
+    else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernel_name = "AVX2";
+        kernel = distanceAVX2;
+    }
+#endif
+    if (name != NULL) {
+        *name = kernel_name;
+    }
+    return kernel;
+}
@@ -0,0 +1,29 @@
+/*
+ *  distance.h
+ *  Squared Euclidean distance between input points, with SIMD kernels picked at runtime.
+ */
+
+#include <cstdlib>
+
+#ifndef DISTANCE_H
+#define DISTANCE_H
+
+// Rows given to the distance kernels hold a multiple of this many floats (zero padded) and start on a
+// 64-byte boundary
+static const int DISTANCE_PADDING = 16;
+
+static inline int paddedDims(int D) { return (D + DISTANCE_PADDING - 1) / DISTANCE_PADDING * DISTANCE_PADDING; }
+
+/*
+    Squared distance between the padded rows x1 and x2 of D floats (D a multiple of DISTANCE_PADDING).
+    Once a partial sum exceeds bound the kernel may stop early and return it: a result above bound only
+    says that the distance is above bound. With bound = FLT_MAX the distance is always complete, and a
+    result not above bound is always the complete distance.
+*/
+typedef float (*DistanceKernel)(const float* x1, const float* x2, int D, float bound);
+
+// Best kernel for this CPU: AVX-512 or AVX2 with FMA, scalar otherwise. If name is given, it is set to a
+// description of the kernel.
+DistanceKernel selectDistanceKernel(const char** name = NULL);
+
+#endif
@@ -0,0 +1,193 @@
+#include <cmath>
+#include <cfloat>
+
+#include "edgeforces.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EDGE_FORCES_X86
+#include <immintrin.h>
+#endif
+
+
+// KL divergence term of one edge, exactly as the scalar path computes it
+static inline float klTerm(float p, float D)
+{
+    return p * log((p + FLT_MIN) / ((1.0 / (1.0 + D)) + FLT_MIN));
+}
+
+
+static void edgeForcesScalar(const int64_t* row_P, const int* col_P, const float* val_P, float exaggeration,
+                             const float* Y, int no_dims, int stride, int begin, int end, float* pos_f, bool eval_error,
+                             float* P_sum, float* C)
+{
+    for (int n = begin; n < end; n++) {
+        for (int d = 0; d < no_dims; d++) {
+            pos_f[d * stride + n] = .0;
+        }
+        for (int64_t i = row_P[n]; i < row_P[n + 1]; i++) {
+
+            // Compute pairwise distance and Q-value
+            float D = .0;
+            int m = col_P[i];
+            float p = val_P[i] * exaggeration;
+            for (int d = 0; d < no_dims; d++) {
+                float t = Y[d * stride + n] - Y[d * stride + m];
+                D += t * t;
+            }
+
+            // Sometimes we want to compute error on the go
+            if (eval_error) {
+                *P_sum += p;
+                *C += klTerm(p, D);
+            }
+
+            D = p / (1.0 + D);
+            // Sum positive force
+            for (int d = 0; d < no_dims; d++) {
+                pos_f[d * stride + n] += D * (Y[d * stride + n] - Y[d * stride + m]);
+            }
+        }
+    }
+}
+
+
+#ifdef EDGE_FORCES_X86
+
+__attribute__((target("avx2")))
+static inline float horizontalSum(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+
+// 8 edges at a time: the neighbour coordinates are gathered from the planes of Y, the tail of a row is
+// masked (masked lanes have P = 0 and gather point 0, so they add nothing)
+template <int Dims>
+__attribute__((target("avx2,fma")))
+static void edgeForcesAVX2(const int64_t* row_P, const int* col_P, const float* val_P, float exaggeration,
+                           const float* Y, int, int stride, int begin, int end, float* pos_f, bool eval_error,
+                           float* P_sum, float* C)
+{
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    for (int n = begin; n < end; n++) {
+        __m256 y_n[Dims], force[Dims];
+        for (int d = 0; d < Dims; d++) {
+            y_n[d] = _mm256_set1_ps(Y[d * stride + n]);
+            force[d] = _mm256_setzero_ps();
+        }
+        for (int64_t i = row_P[n]; i < row_P[n + 1]; i += 8) {
+            __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32((int) (row_P[n + 1] - i)), lane);
+            __m256i col = _mm256_maskload_epi32(col_P + i, mask);
+            __m256 P = _mm256_mul_ps(_mm256_maskload_ps(val_P + i, mask), _mm256_set1_ps(exaggeration));
+
+            __m256 diff[Dims];
+            __m256 D = _mm256_setzero_ps();
+            for (int d = 0; d < Dims; d++) {
+                diff[d] = _mm256_sub_ps(y_n[d], _mm256_i32gather_ps(Y + d * stride, col, 4));
+                D = _mm256_fmadd_ps(diff[d], diff[d], D);
+            }
+            if (eval_error) {
+                float p[8], dist[8];
+                _mm256_storeu_ps(p, P);
+                _mm256_storeu_ps(dist, D);
+                for (int k = 0; k < 8 && i + k < row_P[n + 1]; k++) {
+                    *P_sum += p[k];
+                    *C += klTerm(p[k], dist[k]);
+                }
+            }
+
+            __m256 mult = _mm256_div_ps(P, _mm256_add_ps(one, D));
+            for (int d = 0; d < Dims; d++) {
+                force[d] = _mm256_fmadd_ps(mult, diff[d], force[d]);
+            }
+        }
+
+        for (int d = 0; d < Dims; d++) {
+            pos_f[d * stride + n] = horizontalSum(force[d]);
+        }
+    }
+}
+
+
+// As edgeForcesAVX2, 16 edges at a time
+template <int Dims>
+__attribute__((target("avx512f")))
+static void edgeForcesAVX512(const int64_t* row_P, const int* col_P, const float* val_P, float exaggeration,
+                             const float* Y, int, int stride, int begin, int end, float* pos_f, bool eval_error,
+                             float* P_sum, float* C)
+{
+    const __m512 one = _mm512_set1_ps(1.0f);
+    for (int n = begin; n < end; n++) {
+        __m512 y_n[Dims], force[Dims];
+        for (int d = 0; d < Dims; d++) {
+            y_n[d] = _mm512_set1_ps(Y[d * stride + n]);
+            force[d] = _mm512_setzero_ps();
+        }
+        for (int64_t i = row_P[n]; i < row_P[n + 1]; i += 16) {
+            int count = (int) (row_P[n + 1] - i);
+            __mmask16 mask = count >= 16 ? (__mmask16) 0xFFFF : (__mmask16) ((1u << count) - 1);
+            __m512i col = _mm512_maskz_loadu_epi32(mask, col_P + i);
+            __m512 P = _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, val_P + i), _mm512_set1_ps(exaggeration));
+
+            __m512 diff[Dims];
+            __m512 D = _mm512_setzero_ps();
+            for (int d = 0; d < Dims; d++) {
+                // (masked gather with a defined source, as the plain one trips -Wmaybe-uninitialized in GCC)
+                __m512 y = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), (__mmask16) 0xFFFF, col, Y + d * stride, 4);
+                diff[d] = _mm512_sub_ps(y_n[d], y);
+                D = _mm512_fmadd_ps(diff[d], diff[d], D);
+            }
+            if (eval_error) {
+                float p[16], dist[16];
+                _mm512_storeu_ps(p, P);
+                _mm512_storeu_ps(dist, D);
+                for (int k = 0; k < 16 && k < count; k++) {
+                    *P_sum += p[k];
+                    *C += klTerm(p[k], dist[k]);
+                }
+            }
+
+            __m512 mult = _mm512_div_ps(P, _mm512_add_ps(one, D));
+            for (int d = 0; d < Dims; d++) {
+                force[d] = _mm512_fmadd_ps(mult, diff[d], force[d]);
+            }
+        }
+        for (int d = 0; d < Dims; d++) {
+            // (masked extracts, for the same reason)
+            __m512d v = _mm512_castps_pd(force[d]);
+            __m256 lo = _mm256_castpd_ps(_mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), (__mmask8) 0xF, v, 0));
+            __m256 hi = _mm256_castpd_ps(_mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), (__mmask8) 0xF, v, 1));
+            pos_f[d * stride + n] = horizontalSum(_mm256_add_ps(lo, hi));
+        }
+    }
+}
+
+#endif
+
+
+EdgeForcesKernel selectEdgeForcesKernel(int no_dims, const char** name)
+{
+    const char* kernel_name = "scalar";
+    EdgeForcesKernel kernel = edgeForcesScalar;
+#ifdef EDGE_FORCES_X86
+    __builtin_cpu_init();
+    if (no_dims == 2 || no_dims == 3) {
+        if (__builtin_cpu_supports("avx512f")) {
+            kernel_name = "AVX-512";
+            kernel = no_dims == 2 ? edgeForcesAVX512<2> : edgeForcesAVX512<3>;
+        }
+        else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            kernel_name = "AVX2";
+            kernel = no_dims == 2 ? edgeForcesAVX2<2> : edgeForcesAVX2<3>;
+        }
+    }
+#endif
+    if (name != NULL) {
+        *name = kernel_name;
+    }
+    return kernel;
+}
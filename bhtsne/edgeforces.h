@@ -0,0 +1,28 @@
+/*
+ *  edgeforces.h
+ *  Attractive (edge) forces of t-SNE over the sparse P matrix, with SIMD kernels picked at runtime.
+ */
+
+#include <cstdlib>
+#include <stdint.h>
+
+#ifndef EDGEFORCES_H
+#define EDGEFORCES_H
+
+/*
+    Attractive forces of rows [begin, end) of the CSR matrix (row_P, col_P, val_P), its values multiplied by
+    exaggeration (p_i below is val_P[i] * exaggeration; P itself is never written to), over a map stored as
+    no_dims planes of stride floats (coordinate d of point n at Y[d * stride + n]; pos_f likewise):
+        pos_f[n] = sum_i p_i q_i (y_n - y_col_P[i]),   q_i = 1 / (1 + |y_n - y_col_P[i]|^2)
+    With eval_error, the same pass also adds sum_i p_i to *P_sum and the KL terms sum_i p_i log(p_i / q_i)
+    to *C.
+*/
+typedef void (*EdgeForcesKernel)(const int64_t* row_P, const int* col_P, const float* val_P, float exaggeration,
+                                 const float* Y, int no_dims, int stride, int begin, int end, float* pos_f, bool eval_error,
+                                 float* P_sum, float* C);
+
+// Best kernel for this CPU and map dimensionality: AVX-512 or AVX2 gathers for 2D and 3D maps, scalar
+// otherwise. If name is given, it is set to a description of the kernel.
+EdgeForcesKernel selectEdgeForcesKernel(int no_dims, const char** name = NULL);
+
+#endif
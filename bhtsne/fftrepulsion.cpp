@@ -0,0 +1,329 @@
+#include <cmath>
+#include <cfloat>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "fftrepulsion.h"
+
+
+const float FFTRepulsion::MAX_BOX_WIDTH = 1.0f;
+
+
+FFTRepulsion::FFTRepulsion() : n_boxes(0), n_grid(0), fft_size(0) {}
+
+
+// Compute the repulsive forces of all points of a 2D map into neg_f and Q (N), in point order. Y and
+// neg_f hold an x plane and a y plane of stride floats each.
+void FFTRepulsion::computeNonEdgeForces(const float* Y, int stride, int N, float* neg_f, float* Q)
+{
+    const int p = INTERP_POINTS;
+    const float* Y_x = Y;
+    const float* Y_y = Y + stride;
+
+    // Square domain around the map, split into boxes
+    float min_Y = FLT_MAX, max_Y = -FLT_MAX;
+#ifdef _OPENMP
+    #pragma omp parallel for reduction(min:min_Y) reduction(max:max_Y)
+#endif
+    for (int i = 0; i < N; i++) {
+        min_Y = std::min(min_Y, std::min(Y_x[i], Y_y[i]));
+        max_Y = std::max(max_Y, std::max(Y_x[i], Y_y[i]));
+    }
+    float span = std::max(max_Y - min_Y, 1e-5f);
+    setupGrid(span);
+    float box_width = span / n_boxes;
+    double spacing = (double) box_width / p;
+
+    // Charges are taken relative to the middle of the domain, which keeps |y|^2 small
+    float origin = min_Y + .5f * span;
+
+    // Box and interpolation weights of every point. Nodes sit at (k + 1/2) / p within a box.
+    float node_pos[INTERP_POINTS], denominator[INTERP_POINTS];
+    for (int k = 0; k < p; k++) {
+        node_pos[k] = (k + .5f) / p;
+    }
+    for (int k = 0; k < p; k++) {
+        denominator[k] = 1.0f;
+        for (int m = 0; m < p; m++) {
+            if (m != k) denominator[k] *= node_pos[k] - node_pos[m];
+        }
+    }
+    point_node.resize(N);
+    point_weights.resize(N * 2 * p);
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < N; i++) {
+        int box[2];
+        for (int d = 0; d < 2; d++) {
+            float x = (Y[d * stride + i] - min_Y) / box_width;
+            box[d] = std::min((int) x, n_boxes - 1);
+            x -= box[d];
+            float* w = &point_weights[(i * 2 + d) * p];
+            for (int k = 0; k < p; k++) {
+                w[k] = 1.0f / denominator[k];
+                for (int m = 0; m < p; m++) {
+                    if (m != k) w[k] *= x - node_pos[m];
+                }
+            }
+        }
+        point_node[i] = box[1] * p * fft_size + box[0] * p;
+    }
+
+    // Bucket the points by row of boxes. Different rows of boxes own different grid rows, so they are
+    // spread in parallel without conflicts.
+    const int row_stride = p * fft_size;
+    row_start.assign(n_boxes + 1, 0);
+    for (int i = 0; i < N; i++) {
+        row_start[point_node[i] / row_stride + 1]++;
+    }
+    for (int r = 0; r < n_boxes; r++) {
+        row_start[r + 1] += row_start[r];
+    }
+    row_points.resize(N);
+    for (int i = 0; i < N; i++) {
+        row_points[row_start[point_node[i] / row_stride]++] = i;
+    }
+    for (int r = n_boxes; r > 0; r--) {
+        row_start[r] = row_start[r - 1];
+    }
+    row_start[0] = 0;
+
+    computeKernel(spacing);
+
+    // Spread the charges onto the grid
+    int grid_points = fft_size * fft_size;
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < grid_points; i++) {
+        grid_a[i] = .0;
+        grid_b[i] = .0;
+    }
+    double* a = reinterpret_cast<double*>(&grid_a[0]);
+    double* b = reinterpret_cast<double*>(&grid_b[0]);
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1)
+#endif
+    for (int r = 0; r < n_boxes; r++) {
+        for (int j = row_start[r]; j < row_start[r + 1]; j++) {
+            int i = row_points[j];
+            double x = Y_x[i] - origin;
+            double y = Y_y[i] - origin;
+            double sq = x * x + y * y;
+            const float* wx = &point_weights[i * 2 * p];
+            const float* wy = wx + p;
+            for (int ky = 0; ky < p; ky++) {
+                for (int kx = 0; kx < p; kx++) {
+                    double w = wy[ky] * wx[kx];
+                    int node = point_node[i] + ky * fft_size + kx;
+                    a[2 * node] += w;
+                    a[2 * node + 1] += w * x;
+                    b[2 * node] += w * y;
+                    b[2 * node + 1] += w * sq;
+                }
+            }
+        }
+    }
+
+    // Convolve with the kernel: only the first n_grid rows hold charges, and only they are needed back
+    fft2d(&grid_a[0], n_grid, false);
+    fft2d(&grid_b[0], n_grid, false);
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < grid_points; i++) {
+        grid_a[i] *= kernel_hat[i];
+        grid_b[i] *= kernel_hat[i];
+    }
+    fft2d(&grid_a[0], n_grid, true);
+    fft2d(&grid_b[0], n_grid, true);
+
+    // Interpolate the potentials back to the points. With phi = sum_j q_ij^2 [1, y_j1, y_j2, |y_j|^2],
+    // sum_j q_ij = sum_j q_ij^2 (1 + |y_i - y_j|^2) expands into the four potentials; the self term
+    // q_ii = 1 is removed from it.
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < N; i++) {
+        const float* wx = &point_weights[i * 2 * p];
+        const float* wy = wx + p;
+        double phi[4] = { .0, .0, .0, .0 };
+        for (int ky = 0; ky < p; ky++) {
+            for (int kx = 0; kx < p; kx++) {
+                double w = wy[ky] * wx[kx];
+                int node = point_node[i] + ky * fft_size + kx;
+                phi[0] += w * a[2 * node];
+                phi[1] += w * a[2 * node + 1];
+                phi[2] += w * b[2 * node];
+                phi[3] += w * b[2 * node + 1];
+            }
+        }
+        double x = Y_x[i] - origin;
+        double y = Y_y[i] - origin;
+        Q[i] = (1.0 + x * x + y * y) * phi[0] - 2.0 * (x * phi[1] + y * phi[2]) + phi[3] - 1.0;
+        neg_f[i] = x * phi[0] - phi[1];
+        neg_f[stride + i] = y * phi[0] - phi[2];
+    }
+}
+
+
+// Choose the number of boxes for a domain of the given width, and size the grids and FFT tables.
+// The FFT size is rounded up to a power of two, and the boxes then fill it.
+void FFTRepulsion::setupGrid(float span)
+{
+    const int p = INTERP_POINTS;
+    int boxes = std::max(MIN_BOXES, (int) ceilf(span / MAX_BOX_WIDTH));
+    int size = 1;
+    while (size < 2 * boxes * p && size < MAX_FFT_SIZE) {
+        size <<= 1;
+    }
+    n_boxes = size / (2 * p);
+    n_grid = n_boxes * p;
+
+#ifdef _OPENMP
+    int max_threads = omp_get_max_threads();
+#else
+    int max_threads = 1;
+#endif
+    column_buffer.resize(max_threads * COLUMN_BLOCK * size);
+    if (size == fft_size) {
+        return;
+    }
+
+    fft_size = size;
+    twiddle.resize(fft_size / 2);
+    for (int k = 0; k < fft_size / 2; k++) {
+        double angle = -2.0 * M_PI * k / fft_size;
+        twiddle[k] = complex(cos(angle), sin(angle));
+    }
+    bit_reverse.resize(fft_size);
+    int bits = 0;
+    while ((1 << bits) < fft_size) bits++;
+    for (int i = 0; i < fft_size; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++) {
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        bit_reverse[i] = r;
+    }
+
+    grid_a.resize(fft_size * fft_size);
+    grid_b.resize(fft_size * fft_size);
+    kernel_hat.resize(fft_size * fft_size);
+}
+
+
+// Transform of the kernel 1 / (1 + d^2)^2 at all grid offsets, wrapped around (circulant embedding).
+// The kernel is real and even, so its transform is real; the 1 / fft_size^2 of the inverse FFT is
+// folded in. grid_a serves as scratch space.
+void FFTRepulsion::computeKernel(double spacing)
+{
+    int n = fft_size;
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int r = 0; r < n; r++) {
+        double dy = (r < n / 2 ? r : n - r) * spacing;
+        for (int c = 0; c < n; c++) {
+            double dx = (c < n / 2 ? c : n - c) * spacing;
+            double q = 1.0 / (1.0 + dx * dx + dy * dy);
+            grid_a[r * n + c] = q * q;
+        }
+    }
+    fft2d(&grid_a[0], n, false);
+
+    double scale = 1.0 / ((double) n * n);
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < n * n; i++) {
+        kernel_hat[i] = grid_a[i].real() * scale;
+    }
+}
+
+
+// In-place radix-2 FFT of fft_size points (unnormalized; inverse uses the conjugate twiddles)
+void FFTRepulsion::fft(complex* a, bool inverse) const
+{
+    int n = fft_size;
+    for (int i = 0; i < n; i++) {
+        int j = bit_reverse[i];
+        if (i < j) std::swap(a[i], a[j]);
+    }
+    double* v = reinterpret_cast<double*>(a);
+    const double* w = reinterpret_cast<const double*>(&twiddle[0]);
+    double sign = inverse ? -1.0 : 1.0;
+    for (int half = 1; half < n; half <<= 1) {
+        int step = n / (2 * half);
+        for (int i = 0; i < n; i += 2 * half) {
+            for (int k = 0; k < half; k++) {
+                double w_re = w[2 * k * step];
+                double w_im = sign * w[2 * k * step + 1];
+                int u = 2 * (i + k), t = 2 * (i + k + half);
+                double t_re = v[t] * w_re - v[t + 1] * w_im;
+                double t_im = v[t] * w_im + v[t + 1] * w_re;
+                v[t] = v[u] - t_re;
+                v[t + 1] = v[u + 1] - t_im;
+                v[u] += t_re;
+                v[u + 1] += t_im;
+            }
+        }
+    }
+}
+
+
+// 2D FFT of an fft_size x fft_size grid of which only the first rows are of interest: a forward
+// transform assumes the other rows are zero, an inverse one does not compute them
+void FFTRepulsion::fft2d(complex* a, int rows, bool inverse)
+{
+    int n = fft_size;
+    if (!inverse) {
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (int r = 0; r < rows; r++) {
+            fft(a + r * n, false);
+        }
+    }
+
+    // Columns, a block at a time through a contiguous buffer
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int c0 = 0; c0 < n; c0 += COLUMN_BLOCK) {
+#ifdef _OPENMP
+        complex* buffer = &column_buffer[omp_get_thread_num() * COLUMN_BLOCK * n];
+#else
+        complex* buffer = &column_buffer[0];
+#endif
+        int width = std::min(COLUMN_BLOCK, n - c0);
+        for (int r = 0; r < n; r++) {
+            for (int c = 0; c < width; c++) {
+                buffer[c * n + r] = a[r * n + c0 + c];
+            }
+        }
+        for (int c = 0; c < width; c++) {
+            fft(buffer + c * n, inverse);
+        }
+        for (int r = 0; r < n; r++) {
+            for (int c = 0; c < width; c++) {
+                a[r * n + c0 + c] = buffer[c * n + r];
+            }
+        }
+    }
+
+    if (inverse) {
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (int r = 0; r < rows; r++) {
+            fft(a + r * n, true);
+        }
+    }
+}
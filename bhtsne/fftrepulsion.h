@@ -0,0 +1,72 @@
+/*
+ *  fftrepulsion.h
+ *  Header file for the interpolation-based (FFT) repulsive forces of 2D maps.
+ */
+
+#include <complex>
+#include <vector>
+
+#ifndef FFTREPULSION_H
+#define FFTREPULSION_H
+
+
+/*
+    Repulsive forces by polynomial interpolation on a grid and FFT convolution (as in FIt-SNE, Linderman
+    et al., 2019), for 2D maps.
+
+    The map is covered by n_boxes x n_boxes square boxes, each with INTERP_POINTS x INTERP_POINTS
+    equispaced Lagrange nodes; together the nodes form one regular grid. The charges [1, y1, y2, |y|^2]
+    of every point are spread onto the nodes of its box, convolved with the squared Cauchy kernel
+    1 / (1 + d^2)^2 over the grid, and interpolated back to the points, from which
+        Q_i = sum_j 1 / (1 + |y_i - y_j|^2)
+        neg_f_i = sum_j (y_i - y_j) / (1 + |y_i - y_j|^2)^2
+    follow. The convolution is a zero-padded circulant one, done with a radix-2 FFT of fft_size^2 points.
+    The cost is O(N) plus a few FFTs of a grid that grows with the extent of the map, not with N.
+*/
+class FFTRepulsion
+{
+	// Lagrange nodes per box and dimension
+	static const int INTERP_POINTS = 3;
+	// Smallest number of boxes per dimension, and the largest box width (in map units) while the FFT allows
+	static const int MIN_BOXES = 50;
+	static const float MAX_BOX_WIDTH;
+	// Largest FFT size per dimension, which bounds the grid for maps with far outliers
+	static const int MAX_FFT_SIZE = 4096;
+	// Columns transformed together, gathered into contiguous rows
+	static const int COLUMN_BLOCK = 16;
+
+	typedef std::complex<double> complex;
+
+	int n_boxes;
+	int n_grid;             // n_boxes * INTERP_POINTS nodes per dimension
+	int fft_size;           // power of two >= 2 * n_grid
+
+	// Per-size FFT tables
+	std::vector<complex> twiddle;
+	std::vector<int> bit_reverse;
+
+	// Grids of fft_size x fft_size: charges [1, y1] and [y2, |y|^2] packed as real and imaginary parts
+	// (the kernel is real, so both halves are convolved at once), and the transformed kernel
+	std::vector<complex> grid_a, grid_b;
+	std::vector<double> kernel_hat;
+	std::vector<complex> column_buffer;
+
+	// Per point: first grid node of its box (row * fft_size + column) and the Lagrange weights
+	// [x weights, y weights]; and the points bucketed by row of boxes
+	std::vector<int> point_node;
+	std::vector<float> point_weights;
+	std::vector<int> row_start;
+	std::vector<int> row_points;
+
+public:
+	FFTRepulsion();
+	void computeNonEdgeForces(const float* Y, int stride, int N, float* neg_f, float* Q);
+
+private:
+	void setupGrid(float span);
+	void computeKernel(double spacing);
+	void fft(complex* a, bool inverse) const;
+	void fft2d(complex* a, int rows, bool inverse);
+};
+
+#endif
@@ -0,0 +1,101 @@
+#include <cfloat>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "inputfile.h"
+
+
+InputFile::InputFile() : fd(-1), N(0), D(0), mean(NULL), max_X(1.0f) {}
+
+InputFile::~InputFile()
+{
+    if (fd >= 0) close(fd);
+    free(mean);
+}
+
+
+bool InputFile::open(const char* path)
+{
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0) return false;
+    int header[2];
+    if (pread(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header) || header[0] <= 0 || header[1] <= 0) {
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    N = header[0];
+    D = header[1];
+    return true;
+}
+
+
+void InputFile::read(int first, int count, float* rows) const
+{
+    // (pread may return short counts on large reads)
+    char* out = (char*) rows;
+    size_t left = (size_t) count * D * sizeof(float);
+    off_t offset = 2 * sizeof(int) + (off_t) first * D * sizeof(float);
+    while (left > 0) {
+        ssize_t got = pread(fd, out, left, offset);
+        if (got <= 0) { fprintf(stderr, "Could not read the input file!\n"); exit(1); }
+        out += got;
+        left -= got;
+        offset += got;
+    }
+    if (mean == NULL) return;
+
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int n = 0; n < count; n++) {
+        float* x = rows + (size_t) n * D;
+        for (int d = 0; d < D; d++) {
+            x[d] = (x[d] - mean[d]) / max_X;
+        }
+    }
+}
+
+
+void InputFile::normalize(int chunk_rows)
+{
+    free(mean);
+    mean = NULL;
+    float* sum = (float*) calloc(D, sizeof(float));
+    float* col_max = (float*) malloc(D * sizeof(float));
+    float* chunk = (float*) malloc((size_t) chunk_rows * D * sizeof(float));
+    if (sum == NULL || col_max == NULL || chunk == NULL) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+    for (int d = 0; d < D; d++) col_max[d] = -FLT_MAX;
+
+    // Threads take columns, each summed over the rows in order (the order zeroMean sums them in)
+    for (int first = 0; first < N; first += chunk_rows) {
+        int count = N - first < chunk_rows ? N - first : chunk_rows;
+        read(first, count, chunk);
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (int d = 0; d < D; d++) {
+            for (int n = 0; n < count; n++) {
+                float x = chunk[(size_t) n * D + d];
+                sum[d] += x;
+                if (x > col_max[d]) col_max[d] = x;
+            }
+        }
+    }
+
+    float largest = .0;
+    for (int d = 0; d < D; d++) {
+        sum[d] /= (float) N;
+        if (col_max[d] - sum[d] > largest) largest = col_max[d] - sum[d];
+    }
+    free(col_max);
+    free(chunk);
+    mean = sum;
+    max_X = largest;
+}
@@ -0,0 +1,44 @@
+/*
+ *  inputfile.h
+ *  Header file for the input points read from disk a chunk of rows at a time.
+ */
+
+#include <stddef.h>
+
+#ifndef INPUTFILE_H
+#define INPUTFILE_H
+
+
+/*
+    An [N, D] input matrix in a .bin file (int N, int D, then N * D floats), read on demand instead of
+    held in memory. normalize() makes one pass over the file for the column sums and maxima, which give
+    both the mean and the largest centred value (the max over d of colmax[d] - mean[d]); rows are then read
+    normalized, as TSNE::run normalizes an X in memory, and to the same floats.
+*/
+class InputFile
+{
+public:
+    InputFile();
+    ~InputFile();
+
+    bool open(const char* path);
+    int rows() const { return N; }
+    int dims() const { return D; }
+
+    // Normalize the rows read from now on, reading chunk_rows rows at a time for the pass
+    void normalize(int chunk_rows);
+    // Read rows [first, first + count) to rows (count * D floats)
+    void read(int first, int count, float* rows) const;
+
+private:
+    int fd;
+    int N;
+    int D;
+    float* mean;            // NULL until normalize()
+    float max_X;
+
+    InputFile(const InputFile&);
+    InputFile& operator= (const InputFile&);
+};
+
+#endif
@@ -0,0 +1,434 @@
+#include <cfloat>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "knn.h"
+
+
+const float ApproximateKnn::MIN_UPDATE_RATE = 0.005f;
+
+
+// Copy the rows of X into 64-byte aligned rows of padded_D floats, zero padded
+ApproximateKnn::ApproximateKnn(const float* X, int inp_N, int inp_D, unsigned int inp_seed) :
+    N(inp_N), D(inp_D), padded_D(paddedDims(inp_D)), seed(inp_seed), K(0)
+{
+    distance = selectDistanceKernel();
+    void* ptr;
+    if (posix_memalign(&ptr, 64, (size_t) N * padded_D * sizeof(float)) != 0) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+    points = (float*) ptr;
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int n = 0; n < N; n++) {
+        float* x = points + (size_t) n * padded_D;
+        memcpy(x, X + (size_t) n * D, D * sizeof(float));
+        for (int d = D; d < padded_D; d++) {
+            x[d] = .0;
+        }
+    }
+}
+
+ApproximateKnn::~ApproximateKnn()
+{
+    free(points);
+}
+
+
+// Pseudo-random number from the seed and three values (splitmix64), independent of the thread that draws it
+static inline uint64_t mix(uint64_t z)
+{
+    z += 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+uint64_t ApproximateKnn::random(uint64_t a, uint64_t b, uint64_t c) const
+{
+    return mix(mix(mix(seed + a) + b) + c);
+}
+
+
+// A candidate neighbour for a point, found in the local join
+struct Candidate
+{
+    int point;
+    int neighbour;
+    float dist;
+
+    Candidate() : point(0), neighbour(0), dist(0) {}
+    Candidate(int inp_point, int inp_neighbour, float inp_dist) : point(inp_point), neighbour(inp_neighbour), dist(inp_dist) {}
+    bool operator<(const Candidate& other) const {
+        return point < other.point || (point == other.point && neighbour < other.neighbour);
+    }
+};
+
+
+// Append the entries of a candidate list of M (ended by -1 if shorter)
+static inline void appendList(const int* list, int M, std::vector<int>& out)
+{
+    for (int m = 0; m < M && list[m] >= 0; m++) {
+        out.push_back(list[m]);
+    }
+}
+
+
+/*
+    Find the K nearest neighbours of every point (excluding the point itself) with n_trees random projection
+    trees and NN-descent. Writes them sorted by increasing distance: indices[n * K + k] and the squared
+    distances distances[n * K + k]. K must be below N.
+*/
+void ApproximateKnn::search(int inp_K, int n_trees, int* indices, float* distances, int verbose)
+{
+    K = inp_K;
+    heap_index.assign((size_t) N * K, -1);
+    heap_dist.assign((size_t) N * K, FLT_MAX);
+    heap_new.assign((size_t) N * K, 0);
+
+    initializeFromForest(std::max(n_trees, 1));
+    for (int round = 0; round < MAX_ROUNDS; round++) {
+        int updates = descend(round);
+        if (verbose)
+            fprintf(stderr, " - NN-descent round %d: %d updates\n", round + 1, updates);
+        if (updates <= MIN_UPDATE_RATE * N * K) break;
+    }
+
+    // Sort the lists
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int n = 0; n < N; n++) {
+        std::vector<std::pair<float, int> > list(K);
+        for (int k = 0; k < K; k++) {
+            list[k] = std::make_pair(heap_dist[(size_t) n * K + k], heap_index[(size_t) n * K + k]);
+        }
+        std::sort(list.begin(), list.end());
+        for (int k = 0; k < K; k++) {
+            distances[(size_t) n * K + k] = list[k].first;
+            indices[(size_t) n * K + k] = list[k].second;
+        }
+    }
+
+    std::vector<int>().swap(heap_index);
+    std::vector<float>().swap(heap_dist);
+    std::vector<unsigned char>().swap(heap_new);
+}
+
+
+// Add m at the given distance to the list of n if it is closer than the farthest entry, which it replaces
+// (the callers never offer an entry that is already in the list)
+bool ApproximateKnn::push(int n, int m, float dist)
+{
+    int* index = &heap_index[(size_t) n * K];
+    float* heap = &heap_dist[(size_t) n * K];
+    unsigned char* is_new = &heap_new[(size_t) n * K];
+    if (dist >= heap[0]) return false;
+
+    // Sift down from the root
+    int pos = 0;
+    while (true) {
+        int child = 2 * pos + 1;
+        if (child >= K) break;
+        if (child + 1 < K && heap[child + 1] > heap[child]) child++;
+        if (heap[child] <= dist) break;
+        index[pos] = index[child];
+        heap[pos] = heap[child];
+        is_new[pos] = is_new[child];
+        pos = child;
+    }
+    index[pos] = m;
+    heap[pos] = dist;
+    is_new[pos] = 1;
+    return true;
+}
+
+
+// One random projection tree: order is permuted so that the leaves are contiguous blocks of at most
+// leaf_size points, whose first positions are appended to leaf_start in order
+void ApproximateKnn::buildProjectionTree(int tree, int leaf_size, std::vector<int>& order, std::vector<int>& leaf_start) const
+{
+    order.resize(N);
+    for (int n = 0; n < N; n++) {
+        order[n] = n;
+    }
+    leaf_start.clear();
+
+    // Ranges are split in depth-first order, so that the leaves come out in order
+    std::vector<std::pair<int, int> > stack;
+    stack.push_back(std::make_pair(0, N));
+    while (!stack.empty()) {
+        int lower = stack.back().first;
+        int upper = stack.back().second;
+        stack.pop_back();
+        int size = upper - lower;
+        if (size <= leaf_size) {
+            leaf_start.push_back(lower);
+            continue;
+        }
+
+        // Split by the hyperplane bisecting two random points: a point goes left if it is closer to the first
+        int a = lower + (int) (random(tree, lower, 0) % size);
+        int b = lower + (int) (random(tree, lower, 1) % (size - 1));
+        if (b >= a) b++;
+        const float* x_a = point(order[a]);
+        const float* x_b = point(order[b]);
+        int i = lower, j = upper - 1;
+        while (i <= j) {
+            const float* x = point(order[i]);
+            if (distance(x, x_a, padded_D, FLT_MAX) < distance(x, x_b, padded_D, FLT_MAX)) {
+                i++;
+            }
+            else {
+                std::swap(order[i], order[j]);
+                j--;
+            }
+        }
+
+        // Points that all fall on one side (duplicates) are split in the middle
+        int middle = i;
+        if (middle == lower || middle == upper) {
+            middle = lower + size / 2;
+        }
+        stack.push_back(std::make_pair(middle, upper));
+        stack.push_back(std::make_pair(lower, middle));
+    }
+    leaf_start.push_back(N);
+}
+
+
+// Initial neighbour lists: the closest of the points that share a leaf with a point in any tree, topped up
+// with random points if there are fewer than K of them
+void ApproximateKnn::initializeFromForest(int n_trees)
+{
+    int leaf_size = std::max(K + 1, 32);
+    std::vector<std::vector<int> > order(n_trees), leaf_start(n_trees), leaf_of(n_trees);
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1)
+#endif
+    for (int t = 0; t < n_trees; t++) {
+        buildProjectionTree(t, leaf_size, order[t], leaf_start[t]);
+        leaf_of[t].resize(N);
+        for (int l = 0; l + 1 < (int) leaf_start[t].size(); l++) {
+            for (int p = leaf_start[t][l]; p < leaf_start[t][l + 1]; p++) {
+                leaf_of[t][order[t][p]] = l;
+            }
+        }
+    }
+
+#ifdef _OPENMP
+    #pragma omp parallel
+#endif
+    {
+        std::vector<int> candidates;
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 64)
+#endif
+        for (int n = 0; n < N; n++) {
+            candidates.clear();
+            for (int t = 0; t < n_trees; t++) {
+                int l = leaf_of[t][n];
+                candidates.insert(candidates.end(), order[t].begin() + leaf_start[t][l], order[t].begin() + leaf_start[t][l + 1]);
+            }
+            std::sort(candidates.begin(), candidates.end());
+            candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+            const float* x = point(n);
+            int filled = 0;
+            for (size_t c = 0; c < candidates.size(); c++) {
+                int m = candidates[c];
+                if (m == n) continue;
+                float dist = distance(x, point(m), padded_D, heap_dist[(size_t) n * K]);
+                if (push(n, m, dist) && filled < K) filled++;
+            }
+            for (int draw = 0; filled < K; draw++) {
+                int m = (int) (random(n_trees + n, n, draw) % N);
+                const int* index = &heap_index[(size_t) n * K];
+                if (m == n || std::find(index, index + K, m) != index + K) continue;
+                filled += push(n, m, distance(x, point(m), padded_D, FLT_MAX));
+            }
+        }
+    }
+}
+
+
+// One round of NN-descent; returns the number of list entries that changed
+int ApproximateKnn::descend(int round)
+{
+    const int M = MAX_CANDIDATES;
+
+    // Sample up to M new and M old entries of every list (by pseudo-random priority); the sampled new ones
+    // are old from now on
+    std::vector<int> new_list((size_t) N * M, -1), old_list((size_t) N * M, -1);
+#ifdef _OPENMP
+    #pragma omp parallel
+#endif
+    {
+        std::vector<std::pair<uint64_t, int> > fresh, old;
+#ifdef _OPENMP
+        #pragma omp for
+#endif
+        for (int n = 0; n < N; n++) {
+            fresh.clear();
+            old.clear();
+            for (int k = 0; k < K; k++) {
+                size_t e = (size_t) n * K + k;
+                if (heap_index[e] < 0) continue;
+                uint64_t priority = random(round, n, heap_index[e]);
+                if (heap_new[e]) fresh.push_back(std::make_pair(priority, k));
+                else old.push_back(std::make_pair(priority, k));
+            }
+            int num_new = std::min(M, (int) fresh.size());
+            int num_old = std::min(M, (int) old.size());
+            std::partial_sort(fresh.begin(), fresh.begin() + num_new, fresh.end());
+            std::partial_sort(old.begin(), old.begin() + num_old, old.end());
+            for (int m = 0; m < num_new; m++) {
+                size_t e = (size_t) n * K + fresh[m].second;
+                new_list[(size_t) n * M + m] = heap_index[e];
+                heap_new[e] = 0;
+            }
+            for (int m = 0; m < num_old; m++) {
+                old_list[(size_t) n * M + m] = heap_index[(size_t) n * K + old[m].second];
+            }
+        }
+    }
+
+    // Reverse lists, up to M entries each (in point order, so they do not depend on the threads)
+    std::vector<int> reverse_new((size_t) N * M, -1), reverse_old((size_t) N * M, -1);
+    std::vector<int> count_new(N, 0), count_old(N, 0);
+    for (int n = 0; n < N; n++) {
+        for (int m = 0; m < M; m++) {
+            int j = new_list[(size_t) n * M + m];
+            if (j >= 0 && count_new[j] < M) reverse_new[(size_t) j * M + count_new[j]++] = n;
+            j = old_list[(size_t) n * M + m];
+            if (j >= 0 && count_old[j] < M) reverse_old[(size_t) j * M + count_old[j]++] = n;
+        }
+    }
+
+    // Local join: the entries met at a point are neighbour candidates for each other, in pairs of a new
+    // entry with a new or old one. Points are joined in blocks; the distances of a block are computed in
+    // parallel and the candidates closer than the farthest neighbour are then applied, per point
+    int updates = 0;
+    std::vector<Candidate> found, sorted;
+    for (int first = 0; first < N; first += JOIN_BLOCK) {
+        int last = std::min(first + JOIN_BLOCK, N);
+        found.clear();
+#ifdef _OPENMP
+        #pragma omp parallel
+#endif
+        {
+            std::vector<int> fresh, old;
+            std::vector<Candidate> local;
+#ifdef _OPENMP
+            #pragma omp for schedule(dynamic, 16) nowait
+#endif
+            for (int n = first; n < last; n++) {
+                fresh.clear();
+                old.clear();
+                appendList(&new_list[(size_t) n * M], M, fresh);
+                appendList(&reverse_new[(size_t) n * M], M, fresh);
+                appendList(&old_list[(size_t) n * M], M, old);
+                appendList(&reverse_old[(size_t) n * M], M, old);
+                std::sort(fresh.begin(), fresh.end());
+                fresh.erase(std::unique(fresh.begin(), fresh.end()), fresh.end());
+                std::sort(old.begin(), old.end());
+                old.erase(std::unique(old.begin(), old.end()), old.end());
+
+                for (size_t i = 0; i < fresh.size(); i++) {
+                    for (size_t j = i + 1; j < fresh.size() + old.size(); j++) {
+                        int a = fresh[i];
+                        int b = j < fresh.size() ? fresh[j] : old[j - fresh.size()];
+                        if (a == b) continue;
+                        float bound_a = heap_dist[(size_t) a * K];
+                        float bound_b = heap_dist[(size_t) b * K];
+                        float dist = distance(point(a), point(b), padded_D, std::max(bound_a, bound_b));
+                        if (dist < bound_a) local.push_back(Candidate(a, b, dist));
+                        if (dist < bound_b) local.push_back(Candidate(b, a, dist));
+                    }
+                }
+            }
+#ifdef _OPENMP
+            #pragma omp critical
+#endif
+            found.insert(found.end(), local.begin(), local.end());
+        }
+
+        // Sorted by point and candidate, so that the result does not depend on the order of the threads:
+        // distributed to buckets of consecutive points first, which are sorted in parallel
+        std::vector<size_t> bucket_start(SORT_BUCKETS + 1, 0);
+        for (size_t c = 0; c < found.size(); c++) {
+            bucket_start[bucketOf(found[c].point) + 1]++;
+        }
+        for (int b = 0; b < SORT_BUCKETS; b++) {
+            bucket_start[b + 1] += bucket_start[b];
+        }
+        sorted.resize(found.size());
+        std::vector<size_t> bucket_end(bucket_start.begin(), bucket_start.end() - 1);
+        for (size_t c = 0; c < found.size(); c++) {
+            sorted[bucket_end[bucketOf(found[c].point)]++] = found[c];
+        }
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 16)
+#endif
+        for (int b = 0; b < SORT_BUCKETS; b++) {
+            std::sort(sorted.begin() + bucket_start[b], sorted.begin() + bucket_start[b + 1]);
+        }
+        found.swap(sorted);
+        std::vector<size_t> runs;
+        for (size_t c = 0; c < found.size(); c++) {
+            if (c == 0 || found[c].point != found[c - 1].point) runs.push_back(c);
+        }
+        runs.push_back(found.size());
+
+        int block_updates = 0;
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 64) reduction(+:block_updates)
+#endif
+        for (int r = 0; r < (int) runs.size() - 1; r++) {
+            int n = found[runs[r]].point;
+            const int* index = &heap_index[(size_t) n * K];
+
+            // Skip repeated candidates and current neighbours
+            for (size_t c = runs[r]; c < runs[r + 1]; c++) {
+                int m = found[c].neighbour;
+                if (c > runs[r] && m == found[c - 1].neighbour) continue;
+                if (found[c].dist >= heap_dist[(size_t) n * K] || std::find(index, index + K, m) != index + K) continue;
+                block_updates += push(n, m, found[c].dist);
+            }
+        }
+        updates += block_updates;
+    }
+    return updates;
+}
+
+
+// Estimate the recall of neighbour lists (as written by search) on a sample of points, against exact
+// distances to all points: the fraction of listed neighbours no farther away than the exact K-th neighbour
+float ApproximateKnn::recall(const float* distances, int samples) const
+{
+    samples = std::min(samples, N);
+    int found = 0;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:found)
+#endif
+    for (int s = 0; s < samples; s++) {
+        int n = (int) (random(N, s, 0) % N);
+        const float* x = point(n);
+        std::vector<float> exact;
+        exact.reserve(N - 1);
+        for (int m = 0; m < N; m++) {
+            if (m != n) exact.push_back(distance(x, point(m), padded_D, FLT_MAX));
+        }
+        std::nth_element(exact.begin(), exact.begin() + (K - 1), exact.end());
+        float kth = exact[K - 1];
+        for (int k = 0; k < K; k++) {
+            found += distances[(size_t) n * K + k] <= kth;
+        }
+    }
+    return (float) found / ((float) samples * K);
+}
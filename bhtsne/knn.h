@@ -0,0 +1,69 @@
+/*
+ *  knn.h
+ *  Header file for the approximate nearest neighbours of the input points.
+ */
+
+#include <stdint.h>
+#include <vector>
+
+#include "distance.h"
+
+#ifndef KNN_H
+#define KNN_H
+
+
+/*
+    Approximate K nearest neighbours of all rows of an [N, D] matrix, under the squared Euclidean distance.
+
+    Initial neighbours come from a forest of random projection trees: every tree splits its points
+    recursively by the bisecting hyperplane of two random points among them, down to leaves of about K
+    points, and the points of a leaf are candidates for each other. They are refined by NN-descent (Dong
+    et al., 2011): a neighbour of a neighbour is likely a neighbour, so each round joins the neighbour
+    lists (forward and reverse) of every point, using only the entries that changed since the last round,
+    until few lists change. The candidates of a round are applied in a fixed order, so the result does not
+    depend on the number of threads.
+
+    More trees give better initial lists and a higher recall for more time; recall() estimates it.
+*/
+class ApproximateKnn
+{
+	// Largest number of new (and of old) neighbours per point joined in a round, and the rounds of NN-descent
+	static const int MAX_CANDIDATES = 12;
+	static const int MAX_ROUNDS = 10;
+	// Points whose local joins are computed before the neighbour lists are updated
+	static const int JOIN_BLOCK = 1024;
+	// Buckets of consecutive points by which the candidates of a block are sorted
+	static const int SORT_BUCKETS = 4096;
+	// NN-descent stops when fewer than this fraction of the N * K entries changed in a round
+	static const float MIN_UPDATE_RATE;
+
+	int N;
+	int D;
+	int padded_D;
+	float* points;          // padded copy of the rows, for the distance kernel
+	DistanceKernel distance;
+	uint64_t seed;
+
+	// Neighbour lists of K entries per point, as max-heaps on distance, with flags for new entries
+	int K;
+	std::vector<int> heap_index;
+	std::vector<float> heap_dist;
+	std::vector<unsigned char> heap_new;
+
+public:
+	ApproximateKnn(const float* X, int inp_N, int inp_D, unsigned int inp_seed = 0);
+	~ApproximateKnn();
+	void search(int inp_K, int n_trees, int* indices, float* distances, int verbose = 0);
+	float recall(const float* distances, int samples) const;
+
+private:
+	const float* point(int n) const { return points + (size_t) n * padded_D; }
+	uint64_t random(uint64_t a, uint64_t b, uint64_t c) const;
+	int bucketOf(int n) const { return (int) ((int64_t) n * SORT_BUCKETS / N); }
+	void buildProjectionTree(int tree, int leaf_size, std::vector<int>& order, std::vector<int>& leaf_start) const;
+	void initializeFromForest(int n_trees);
+	int descend(int round);
+	bool push(int n, int m, float dist);
+};
+
+#endif
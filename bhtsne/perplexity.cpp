@@ -0,0 +1,299 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+#include "perplexity.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PERPLEXITY_X86
+#include <immintrin.h>
+#endif
+
+
+const float PerplexityCalibrator::TOLERANCE = 1e-5f;
+
+// Largest step of Newton's method on log beta, and the range of log beta
+static const float MAX_STEP = 4.0f;
+static const float MAX_LOG_BETA = 80.0f;
+
+
+/*
+    exp(x) for x <= 0 (Cephes): x = n ln 2 + r with |r| <= ln 2 / 2, exp(r) by a polynomial of degree 6
+    (relative error below 2e-7), times 2^n. Below EXP_MIN (the log of FLT_MIN) it is 0.
+*/
+static const float EXP_MIN = -87.33654f;
+static const float LOG2E = 1.44269504088896341f;
+static const float LN2_HI = 0.693359375f;
+static const float LN2_LO = -2.12194440e-4f;
+static const float EXP_P0 = 1.9875691500e-4f;
+static const float EXP_P1 = 1.3981999507e-3f;
+static const float EXP_P2 = 8.3334519073e-3f;
+static const float EXP_P3 = 4.1665795894e-2f;
+static const float EXP_P4 = 1.6666665459e-1f;
+static const float EXP_P5 = 5.0000001201e-1f;
+
+static inline float expNonPositive(float x)
+{
+    if (!(x >= EXP_MIN)) return .0f;
+    float n = floorf(x * LOG2E + .5f);
+    float r = x - n * LN2_HI;
+    r = r - n * LN2_LO;
+    float p = EXP_P0;
+    p = p * r + EXP_P1;
+    p = p * r + EXP_P2;
+    p = p * r + EXP_P3;
+    p = p * r + EXP_P4;
+    p = p * r + EXP_P5;
+    p = p * (r * r) + (r + 1.0f);
+    int32_t bits = ((int32_t) n + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+
+static void kernelScalar(const float* d, int K, float beta, float* p, float* sums)
+{
+    float sum = .0, sum_d = .0, sum_dd = .0;
+    for (int j = 0; j < K; j++) {
+        float e = expNonPositive(-beta * d[j]);
+        p[j] = e;
+        sum += e;
+        sum_d += d[j] * e;
+        sum_dd += d[j] * (d[j] * e);
+    }
+    sums[0] = sum;
+    sums[1] = sum_d;
+    sums[2] = sum_dd;
+}
+
+
+#ifdef PERPLEXITY_X86
+
+__attribute__((target("avx2")))
+static inline float horizontalSum(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+
+__attribute__((target("avx2,fma")))
+static inline __m256 expNonPositive(__m256 x)
+{
+    __m256 valid = _mm256_cmp_ps(x, _mm256_set1_ps(EXP_MIN), _CMP_GE_OQ);
+    x = _mm256_max_ps(x, _mm256_set1_ps(EXP_MIN));
+    __m256 n = _mm256_floor_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(LOG2E), _mm256_set1_ps(.5f)));
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_HI), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_LO), r);
+    __m256 p = _mm256_set1_ps(EXP_P0);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P1));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P2));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P3));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P4));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P5));
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+    __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_and_ps(_mm256_mul_ps(p, _mm256_castsi256_ps(bits)), valid);
+}
+
+
+// Blocks of 8 distances, the lanes past K of the last one set to zero
+__attribute__((target("avx2,fma")))
+static void kernelAVX2(const float* d, int K, float beta, float* p, float* sums)
+{
+    __m256 minus_beta = _mm256_set1_ps(-beta);
+    __m256 lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256 sum = _mm256_setzero_ps(), sum_d = _mm256_setzero_ps(), sum_dd = _mm256_setzero_ps();
+    for (int j = 0; j < K; j += 8) {
+        __m256 dj = _mm256_load_ps(d + j);
+        __m256 e = expNonPositive(_mm256_mul_ps(minus_beta, dj));
+        if (j + 8 > K) e = _mm256_and_ps(e, _mm256_cmp_ps(lanes, _mm256_set1_ps((float) (K - j)), _CMP_LT_OQ));
+        _mm256_store_ps(p + j, e);
+        __m256 de = _mm256_mul_ps(dj, e);
+        sum = _mm256_add_ps(sum, e);
+        sum_d = _mm256_add_ps(sum_d, de);
+        sum_dd = _mm256_fmadd_ps(dj, de, sum_dd);
+    }
+    sums[0] = horizontalSum(sum);
+    sums[1] = horizontalSum(sum_d);
+    sums[2] = horizontalSum(sum_dd);
+}
+
+
+__attribute__((target("avx512f")))
+static inline __m512 expNonPositive(__m512 x)
+{
+    // (no clamping: scalef takes any n; a masked round with a defined source, as the plain one trips
+    // -Wmaybe-uninitialized in GCC)
+    __mmask16 valid = _mm512_cmp_ps_mask(x, _mm512_set1_ps(EXP_MIN), _CMP_GE_OQ);
+    __m512 n = _mm512_mask_roundscale_ps(x, (__mmask16) 0xFFFF, _mm512_fmadd_ps(x, _mm512_set1_ps(LOG2E), _mm512_set1_ps(.5f)),
+                                         _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(LN2_HI), x);
+    r = _mm512_fnmadd_ps(n, _mm512_set1_ps(LN2_LO), r);
+    __m512 p = _mm512_set1_ps(EXP_P0);
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P1));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P2));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P3));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P4));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P5));
+    p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+    return _mm512_maskz_scalef_ps(valid, p, n);
+}
+
+
+__attribute__((target("avx512f")))
+static inline float horizontalSum(__m512 v)
+{
+    // (masked extracts with a defined source, as the plain ones trip -Wmaybe-uninitialized in GCC)
+    __m512d v_d = _mm512_castps_pd(v);
+    __m256 lo = _mm256_castpd_ps(_mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), (__mmask8) 0xF, v_d, 0));
+    __m256 hi = _mm256_castpd_ps(_mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), (__mmask8) 0xF, v_d, 1));
+    return horizontalSum(_mm256_add_ps(lo, hi));
+}
+
+
+// As kernelAVX2, over blocks of 16
+__attribute__((target("avx512f")))
+static void kernelAVX512(const float* d, int K, float beta, float* p, float* sums)
+{
+    __m512 minus_beta = _mm512_set1_ps(-beta);
+    __m512 sum = _mm512_setzero_ps(), sum_d = _mm512_setzero_ps(), sum_dd = _mm512_setzero_ps();
+    for (int j = 0; j < K; j += 16) {
+        __m512 dj = _mm512_load_ps(d + j);
+        __m512 e = expNonPositive(_mm512_mul_ps(minus_beta, dj));
+        if (j + 16 > K) e = _mm512_maskz_mov_ps((__mmask16) ((1u << (K - j)) - 1), e);
+        _mm512_store_ps(p + j, e);
+        __m512 de = _mm512_mul_ps(dj, e);
+        sum = _mm512_add_ps(sum, e);
+        sum_d = _mm512_add_ps(sum_d, de);
+        sum_dd = _mm512_fmadd_ps(dj, de, sum_dd);
+    }
+    sums[0] = horizontalSum(sum);
+    sums[1] = horizontalSum(sum_d);
+    sums[2] = horizontalSum(sum_dd);
+}
+
+#endif
+
+
+static PerplexityCalibrator::Kernel selectKernel(const char** name)
+{
+    const char* kernel_name = "scalar";
+    PerplexityCalibrator::Kernel kernel = kernelScalar;
+#ifdef PERPLEXITY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        kernel_name = "AVX-512";
+        kernel = kernelAVX512;
+    }
+    else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernel_name = "AVX2";
+        kernel = kernelAVX2;
+    }
+#endif
+    if (name != NULL) {
+        *name = kernel_name;
+    }
+    return kernel;
+}
+
+const char* PerplexityCalibrator::kernelName()
+{
+    const char* name;
+    selectKernel(&name);
+    return name;
+}
+
+
+static float* allocateAligned(int count)
+{
+    void* ptr;
+    if (posix_memalign(&ptr, 64, count * sizeof(float)) != 0) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+    memset(ptr, 0, count * sizeof(float));
+    return (float*) ptr;
+}
+
+
+PerplexityCalibrator::PerplexityCalibrator(int inp_K, float perplexity) :
+    K(inp_K), log_perplexity(log(perplexity)), kernel(selectKernel(NULL))
+{
+    int padded_K = (K + 15) / 16 * 16;
+    shifted = allocateAligned(padded_K);
+    weights = allocateAligned(padded_K);
+}
+
+PerplexityCalibrator::~PerplexityCalibrator()
+{
+    free(shifted);
+    free(weights);
+}
+
+
+bool PerplexityCalibrator::calibrate(const float* distances, float* P, int* iterations)
+{
+    float min_distance = distances[0];
+    for (int j = 1; j < K; j++) {
+        if (distances[j] < min_distance) min_distance = distances[j];
+    }
+    float total = .0;
+    for (int j = 0; j < K; j++) {
+        shifted[j] = distances[j] - min_distance;
+        total += shifted[j];
+    }
+
+    // All neighbours at the same distance: p is uniform whatever beta
+    if (total == .0f) {
+        for (int j = 0; j < K; j++) {
+            P[j] = 1.0f / K;
+        }
+        *iterations = 0;
+        return fabs(log((float) K) - log_perplexity) < TOLERANCE;
+    }
+
+    // Start at beta = 1 / (mean distance), within a bracket [min_log_beta, max_log_beta] of log beta
+    float log_beta = log(K / total);
+    float min_log_beta = -MAX_LOG_BETA;
+    float max_log_beta = MAX_LOG_BETA;
+    float sums[3];
+    bool found = false;
+    int iter = 0;
+    while (!found && iter < MAX_ITERATIONS) {
+        float beta = exp(log_beta);
+        kernel(shifted, K, beta, weights, sums);
+        iter++;
+
+        // Entropy of the row, and its derivative in log beta
+        float mean = sums[1] / sums[0];
+        float H = beta * mean + log(sums[0]);
+        float Hdiff = H - log_perplexity;
+        if (Hdiff < TOLERANCE && -Hdiff < TOLERANCE) {
+            found = true;
+            break;
+        }
+        float slope = -beta * beta * (sums[2] / sums[0] - mean * mean);
+
+        // H too high: beta must grow
+        if (Hdiff > 0) min_log_beta = log_beta;
+        else max_log_beta = log_beta;
+        float step = slope < 0 ? -Hdiff / slope : (Hdiff > 0 ? MAX_STEP : -MAX_STEP);
+        step = fmin(fmax(step, -MAX_STEP), MAX_STEP);
+        float next = log_beta + step;
+        if (!(next > min_log_beta && next < max_log_beta)) {
+            next = (min_log_beta + max_log_beta) / 2;
+        }
+        if (next == log_beta) break;
+        log_beta = next;
+    }
+
+    // Row-normalize the kernel at the last beta
+    for (int j = 0; j < K; j++) {
+        P[j] = weights[j] / sums[0];
+    }
+    *iterations = iter;
+    return found;
+}
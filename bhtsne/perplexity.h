@@ -0,0 +1,56 @@
+/*
+ *  perplexity.h
+ *  Header file for the calibration of the Gaussian kernel of every input point to the perplexity.
+ */
+
+#ifndef PERPLEXITY_H
+#define PERPLEXITY_H
+
+
+/*
+    The conditional similarities p_{j | i} = exp(-beta d_j) / sum_k exp(-beta d_k) of a point to its K
+    neighbours at squared distances d_j, with beta such that the entropy H of the row is log(perplexity)
+    (within TOLERANCE).
+
+    H falls as beta grows, with dH / d(log beta) = -beta^2 Var(d) (the variance of d under p), so beta is
+    found by Newton's method on log beta, safeguarded by the bracket of the values tried so far: a step
+    leaving the bracket bisects it instead. The kernel, its sum and the first two moments of d are computed
+    in one pass, by SIMD kernels with a polynomial exp picked at runtime. The distances are shifted by the
+    smallest first, which changes neither p nor H, so the kernel never underflows to all zeros.
+
+    One calibrator per thread: it holds the buffers of a row.
+*/
+class PerplexityCalibrator
+{
+public:
+    static const int MAX_ITERATIONS = 200;
+    static const float TOLERANCE;
+
+    PerplexityCalibrator(int K, float perplexity);
+    ~PerplexityCalibrator();
+
+    // Write the p_{j | i} of the squared distances of a row to P; returns whether H came within the tolerance,
+    // and the number of kernel evaluations it took in iterations
+    bool calibrate(const float* distances, float* P, int* iterations);
+
+    // Description of the kernel used on this CPU
+    static const char* kernelName();
+
+    /*
+        Sets p[j] = exp(-beta d[j]) for the K distances, and sums[0], sums[1] and sums[2] to the sums of
+        p[j], d[j] p[j] and d[j]^2 p[j]. d and p are 64-byte aligned and hold K rounded up to 16 floats.
+    */
+    typedef void (*Kernel)(const float* d, int K, float beta, float* p, float* sums);
+
+private:
+    int K;
+    float log_perplexity;
+    Kernel kernel;
+    float* shifted;         // distances minus the smallest
+    float* weights;         // the kernel at the last beta
+
+    PerplexityCalibrator(const PerplexityCalibrator&);
+    PerplexityCalibrator& operator= (const PerplexityCalibrator&);
+};
+
+#endif
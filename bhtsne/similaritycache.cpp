@@ -0,0 +1,117 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "similaritycache.h"
+#include "csrfile.h"
+
+
+static const char CACHE_MAGIC[8] = { 'T', 'S', 'N', 'E', '-', 'P', '0', '3' };
+
+// Floats of X hashed per chunk; the chunk hashes are combined in order, so the key does not depend on
+// the number of threads
+static const size_t HASH_CHUNK = 1 << 16;
+
+
+// splitmix64 finalizer
+static inline uint64_t mix(uint64_t z)
+{
+    z += 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Hash of count floats, over four independent lanes of 64-bit words
+static uint64_t hashFloats(const float* x, size_t count, uint64_t seed)
+{
+    uint64_t lanes[4] = { mix(seed), mix(seed + 1), mix(seed + 2), mix(seed + 3) };
+    size_t words = count / 2;
+    size_t w = 0;
+    for (; w + 4 <= words; w += 4) {
+        for (int j = 0; j < 4; j++) {
+            uint64_t word;
+            memcpy(&word, x + 2 * (w + j), sizeof(word));
+            lanes[j] = (lanes[j] ^ word) * 0x100000001B3ULL;
+            lanes[j] ^= lanes[j] >> 29;
+        }
+    }
+    uint64_t h = mix(lanes[0]) ^ mix(lanes[1] + 1) ^ mix(lanes[2] + 2) ^ mix(lanes[3] + 3);
+    for (size_t i = 2 * w; i < count; i++) {
+        uint32_t word;
+        memcpy(&word, x + i, sizeof(word));
+        h = mix(h ^ word);
+    }
+    return h;
+}
+
+
+SimilarityCache::SimilarityCache(const char* dir, const float* X, int inp_N, int D, float perplexity, int K, int knn_method, int knn_trees) :
+    N(inp_N), mapping(NULL), mapping_size(0)
+{
+    size_t total = (size_t) N * D;
+    int num_chunks = (int) ((total + HASH_CHUNK - 1) / HASH_CHUNK);
+    uint64_t* chunk_hash = (uint64_t*) malloc(num_chunks * sizeof(uint64_t));
+    if (num_chunks > 0 && chunk_hash == NULL) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int c = 0; c < num_chunks; c++) {
+        size_t first = (size_t) c * HASH_CHUNK;
+        size_t count = total - first < HASH_CHUNK ? total - first : HASH_CHUNK;
+        chunk_hash[c] = hashFloats(X + first, count, c);
+    }
+
+    uint32_t perplexity_bits;
+    memcpy(&perplexity_bits, &perplexity, sizeof(perplexity_bits));
+    key = mix(N);
+    key = mix(key ^ (uint64_t) D);
+    key = mix(key ^ perplexity_bits);
+    key = mix(key ^ (uint64_t) K);
+    key = mix(key ^ (uint64_t) knn_method);
+    key = mix(key ^ (uint64_t) knn_trees);
+    for (int c = 0; c < num_chunks; c++) {
+        key = mix(key ^ chunk_hash[c]);
+    }
+    free(chunk_hash);
+
+    char name[64];
+    snprintf(name, sizeof(name), "/tsne_P_%016llx.bin", (unsigned long long) key);
+    file = std::string(dir) + name;
+}
+
+SimilarityCache::~SimilarityCache()
+{
+    if (mapping != NULL) {
+        munmap(mapping, mapping_size);
+    }
+}
+
+
+bool SimilarityCache::load(int64_t** row_P, int** col_P, float** val_P)
+{
+    // Check that the file is the one of this key
+    int file_N;
+    const void* extra;
+    void* ptr = mapCsrFile(file, CACHE_MAGIC, sizeof(key), &mapping_size, &file_N, &extra, row_P, col_P, val_P);
+    if (ptr == NULL) return false;
+    uint64_t file_key;
+    memcpy(&file_key, extra, sizeof(file_key));
+    if (file_key != key || file_N != N) {
+        munmap(ptr, mapping_size);
+        return false;
+    }
+    mapping = ptr;
+    return true;
+}
+
+
+bool SimilarityCache::save(const int64_t* row_P, const int* col_P, const float* val_P) const
+{
+    return writeCsrFile(file, CACHE_MAGIC, &key, sizeof(key), N, row_P, col_P, val_P);
+}
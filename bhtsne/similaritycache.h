@@ -0,0 +1,44 @@
+/*
+ *  similaritycache.h
+ *  Header file for the on-disk cache of the symmetrized input similarities.
+ */
+
+#include <stdint.h>
+#include <string>
+
+#ifndef SIMILARITYCACHE_H
+#define SIMILARITYCACHE_H
+
+
+/*
+    Cache of the symmetrized, normalized P (row_P, col_P, val_P) of a data set in a directory, one file per
+    key. The key is a hash of the (normalized) input X and of everything else P depends on: the perplexity,
+    K and the nearest neighbour search. Files are read with mmap (read-only), and written to a temporary
+    name first, so that a file under its final name is always complete.
+
+    File layout: a CSR file (see csrfile.h) with the key as its extra header bytes.
+*/
+class SimilarityCache
+{
+public:
+    SimilarityCache(const char* dir, const float* X, int N, int D, float perplexity, int K, int knn_method, int knn_trees);
+    ~SimilarityCache();
+
+    // Point the arrays at the cached P if there is one (they stay valid until the cache is destroyed,
+    // and must not be freed)
+    bool load(int64_t** row_P, int** col_P, float** val_P);
+    bool save(const int64_t* row_P, const int* col_P, const float* val_P) const;
+    const char* path() const { return file.c_str(); }
+
+private:
+    std::string file;
+    uint64_t key;
+    int N;
+    void* mapping;
+    size_t mapping_size;
+
+    SimilarityCache(const SimilarityCache&);
+    SimilarityCache& operator= (const SimilarityCache&);
+};
+
+#endif
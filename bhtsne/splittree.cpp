@@ -2,268 +2,924 @@
 #include <cfloat>
 #include <cstdlib>
 #include <cstdio>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "splittree.h"
 
 
-// Checks whether a point lies in a cell
-bool Cell::containsPoint(float point[])
+// Move bit b of bits to bit b * no_dims, for the interleaving of per-dimension Morton bits
+static inline uint64_t spreadBits(uint32_t bits, int no_dims, int levels)
 {
-    for (int i = 0; i< n_dims; ++i) {
-        if (abs_d(center[i] - point[i]) > width[i]) {
-            return false;
-        }
+    uint64_t x = bits;
+    if (no_dims == 2) {
+        x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+        x = (x | (x << 8))  & 0x00FF00FF00FF00FFULL;
+        x = (x | (x << 4))  & 0x0F0F0F0F0F0F0F0FULL;
+        x = (x | (x << 2))  & 0x3333333333333333ULL;
+        x = (x | (x << 1))  & 0x5555555555555555ULL;
+        return x;
+    }
+    if (no_dims == 3) {
+        x &= 0x1FFFFF;
+        x = (x | (x << 32)) & 0x001F00000000FFFFULL;
+        x = (x | (x << 16)) & 0x001F0000FF0000FFULL;
+        x = (x | (x << 8))  & 0x100F00F00F00F00FULL;
+        x = (x | (x << 4))  & 0x10C30C30C30C30C3ULL;
+        x = (x | (x << 2))  & 0x1249249249249249ULL;
+        return x;
     }
-    return true;
+    uint64_t spread = 0;
+    for (int b = 0; b < levels; b++) {
+        spread |= ((x >> b) & 1) << (b * no_dims);
+    }
+    return spread;
 }
 
 
 // Default constructor for quadtree -- build tree, too!
-SplitTree::SplitTree(float* inp_data, int N, int no_dims)
+template <int Dims>
+SplitTree<Dims>::SplitTree(float* inp_data, int inp_stride, int N, int inp_no_dims, BuildMode mode)
 {
-    QT_NO_DIMS = no_dims;
-    num_children = 1 << no_dims;
+    QT_NO_DIMS = Dims > 0 ? Dims : inp_no_dims;
+    build_mode = mode;
+    code_levels = std::min(64 / no_dims(), 32);
+
+    rebuild(inp_data, inp_stride, N);
+}
 
-    // Compute mean, width, and height of current map (boundaries of SplitTree)
-    float* mean_Y = new float[QT_NO_DIMS];
-    for (int d = 0; d < QT_NO_DIMS; d++) {
+
+// Rebuild the tree on new data, reusing the node storage of previous builds
+template <int Dims>
+void SplitTree<Dims>::rebuild(float* inp_data, int inp_stride, int N)
+{
+    data = inp_data;
+    data_stride = inp_stride;
+    nodes.clear();
+    node_data.clear();
+
+    newNodes(1);
+    computeBoundary(N);
+    if (build_mode == BUILD_MORTON) {
+        fillMorton(N);
+    }
+    else {
+        fill(N);
+    }
+}
+
+
+// Append count empty leaves to the node array and return the index of the first one
+template <int Dims>
+int SplitTree<Dims>::newNodes(int count)
+{
+    int first = nodes.size();
+    Node empty = { -1, 0, -1, -1, .0, { .0 } };
+    nodes.resize(first + count, empty);
+    if (Dims == 0) {
+        node_data.resize((first + count) * 3 * no_dims(), .0);
+    }
+    return first;
+}
+
+
+// Compute mean and half-width of the current map (boundaries of the root node)
+template <int Dims>
+void SplitTree<Dims>::computeBoundary(int N)
+{
+    float* mean_Y = center(0);
+    float* width_Y = width(0);
+    for (int d = 0; d < no_dims(); d++) {
         mean_Y[d] = .0;
+        width_Y[d] = .0;
     }
 
-    float*  min_Y = new float[QT_NO_DIMS];
-    for (int d = 0; d < QT_NO_DIMS; d++) {
-        min_Y[d] =  DBL_MAX;
+    // Sum by blocks of QT_SUM_BLOCK points, then the blocks in order, so that the mean (and with it every
+    // cell) does not depend on how the points were shared between the threads
+    const int blocks = (N + QT_SUM_BLOCK - 1) / QT_SUM_BLOCK;
+    block_sums.resize((size_t) blocks * no_dims());
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int b = 0; b < blocks; b++) {
+        const int end = std::min(N, (b + 1) * QT_SUM_BLOCK);
+        for (int d = 0; d < no_dims(); d++) {
+            const float* data_d = data + d * data_stride;
+            float sum = .0;
+            for (int n = b * QT_SUM_BLOCK; n < end; n++) {
+                sum += data_d[n];
+            }
+            block_sums[b * no_dims() + d] = sum;
+        }
+    }
+    for (int b = 0; b < blocks; b++) {
+        for (int d = 0; d < no_dims(); d++) {
+            mean_Y[d] += block_sums[b * no_dims() + d];
+        }
     }
-    float*  max_Y = new float[QT_NO_DIMS];
-    for (int d = 0; d < QT_NO_DIMS; d++) {
-        max_Y[d] = -DBL_MAX;
+    for (int d = 0; d < no_dims(); d++) {
+        mean_Y[d] /= (float) N;
     }
 
+    // max(max_Y - mean_Y, mean_Y - min_Y) is the largest deviation from the mean
+#ifdef _OPENMP
+    #pragma omp parallel for reduction(max:width_Y[:no_dims()])
+#endif
     for (int n = 0; n < N; n++) {
-        for (int d = 0; d < QT_NO_DIMS; d++) {
-            mean_Y[d] += inp_data[n * QT_NO_DIMS + d];
-            min_Y[d] = min(min_Y[d], inp_data[n * QT_NO_DIMS + d]);
-            max_Y[d] = max(max_Y[d], inp_data[n * QT_NO_DIMS + d]);
+        for (int d = 0; d < no_dims(); d++) {
+            width_Y[d] = max(width_Y[d], abs_d(data[d * data_stride + n] - mean_Y[d]));
         }
-
     }
+    float m = -1;
+    for (int d = 0; d < no_dims(); d++) {
+        width_Y[d] += 1e-5;
+        m = max(m, width_Y[d]);
+    }
+    nodes[0].max_width = m;
+}
 
-    float* width_Y = new float[QT_NO_DIMS];
-    for (int d = 0; d < QT_NO_DIMS; d++) {
-        mean_Y[d] /= (float) N;
-        width_Y[d] = max(max_Y[d] - mean_Y[d], mean_Y[d] - min_Y[d]) + 1e-5;
+
+// Build SplitTree on dataset
+template <int Dims>
+void SplitTree<Dims>::fill(int N)
+{
+    dup_next.assign(N, -1);
+    for (int i = 0; i < N; i++) {
+        insert(i);
     }
 
-    // Construct SplitTree
-    init(NULL, inp_data, mean_Y, width_Y);
-    fill(N);
-    delete[] max_Y; delete[] min_Y;
+    // Number the points depth-first, so that every cell covers order[begin, begin + cum_size) as after
+    // BUILD_MORTON. A leaf holds its point followed by the points folded into it.
+    order.resize(N);
+    int pos = 0;
+    struct Frame { int next; int end; };
+    Frame stack[QT_MAX_DEPTH + 2];
+    int top = 0;
+    stack[0].next = 0;
+    stack[0].end = 1;
+    while (top >= 0) {
+        int node = stack[top].next++;
+        if (stack[top].next == stack[top].end) {
+            top--;
+        }
+        nodes[node].begin = pos;
+        if (nodes[node].children != -1) {
+            top++;
+            stack[top].next = nodes[node].children;
+            stack[top].end = nodes[node].children + num_children();
+        }
+        else {
+            for (int i = nodes[node].index; i != -1; i = dup_next[i]) {
+                order[pos++] = i;
+            }
+        }
+    }
 }
 
-// Constructor for SplitTree with particular size and parent (do not fill the tree)
-SplitTree::SplitTree(SplitTree* inp_parent, float* inp_data, float* mean_Y, float* width_Y)
+
+// Build SplitTree from the points sorted by Morton code. Cells are created one level at a time: the
+// nodes of a level are contiguous, so the children of all cells that need splitting can be placed with
+// a prefix sum over the level and then filled in parallel.
+template <int Dims>
+void SplitTree<Dims>::fillMorton(int N)
 {
-    QT_NO_DIMS = inp_parent->QT_NO_DIMS;
-    num_children = 1 << QT_NO_DIMS;
+    computeCodes(N);
+    sortCodes(N);
+
+    makeCell(0, 0, N, 0);
+    level_start.clear();
+    level_start.push_back(0);
+    level_start.push_back(1);
+
+    for (int level = 0; level_start[level] < level_start[level + 1]; level++) {
+        int lb = level_start[level];
+        int le = level_start[level + 1];
+
+        // Only non-empty cells holding more than one distinct point are split
+        child_offset.resize(le - lb);
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (int i = lb; i < le; i++) {
+            child_offset[i - lb] = (nodes[i].cum_size > 0 && nodes[i].index == -1) ? num_children() : 0;
+        }
+        int total = exclusiveScan(&child_offset[0], le - lb);
+        newNodes(total);
+
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 64)
+#endif
+        for (int i = lb; i < le; i++) {
+            if (nodes[i].cum_size > 0 && nodes[i].index == -1) {
+                nodes[i].children = le + child_offset[i - lb];
+                splitMorton(i, level);
+            }
+        }
+        level_start.push_back(le + total);
+    }
 
-    init(inp_parent, inp_data, mean_Y, width_Y);
+    // Centers of mass, bottom-up; leaves already hold theirs
+    for (int level = level_start.size() - 3; level >= 0; level--) {
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (int i = level_start[level]; i < level_start[level + 1]; i++) {
+            if (nodes[i].children == -1) continue;
+            float* com = center_of_mass(i);
+            for (int d = 0; d < no_dims(); d++) {
+                com[d] = .0;
+            }
+            for (int c = 0; c < num_children(); c++) {
+                int child = nodes[i].children + c;
+                const float* child_com = center_of_mass(child);
+                for (int d = 0; d < no_dims(); d++) {
+                    com[d] += nodes[child].cum_size * child_com[d];
+                }
+            }
+            for (int d = 0; d < no_dims(); d++) {
+                com[d] /= (float) nodes[i].cum_size;
+            }
+        }
+    }
 }
 
 
-// Main initialization function
-void SplitTree::init(SplitTree* inp_parent, float* inp_data, float* mean_Y, float* width_Y)
+// Compute the Morton code of every point: the child chosen at each of the first code_levels levels,
+// most significant first. Uses the same arithmetic as subdivide, so codes agree with the inserted tree.
+// The half-width at a level is the same for every point, so each dimension is walked down the levels
+// for a block of points at a time (which the compiler vectorizes), and the bits are interleaved after.
+template <int Dims>
+void SplitTree<Dims>::computeCodes(int N)
 {
-    // parent = inp_parent;
-    data = inp_data;
-    is_leaf = true;
-    size = 0;
-    cum_size = 0;
+    codes.resize(N); codes_tmp.resize(N);
+    order.resize(N); order_tmp.resize(N);
+
+    const int block = 16;
+    const float* root_center = center(0);
+    const float* root_width = width(0);
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int n0 = 0; n0 < N; n0 += block) {
+        int count = std::min(block, N - n0);
+        uint64_t code[block];
+        for (int j = 0; j < block; j++) {
+            code[j] = 0;
+        }
+        for (int d = 0; d < no_dims(); d++) {
+            float p[block], c[block];
+            uint32_t bits[block];
+            for (int j = 0; j < block; j++) {
+                p[j] = j < count ? data[d * data_stride + n0 + j] : .0f;
+                c[j] = root_center[d];
+                bits[j] = 0;
+            }
+            float w = root_width[d];
+            for (int level = 0; level < code_levels; level++) {
+                float h = .5f * w;
+                for (int j = 0; j < block; j++) {
+                    uint32_t upper = p[j] > c[j];
+                    bits[j] = (bits[j] << 1) | upper;
+                    c[j] += (float) (2 * (int) upper - 1) * h;      // c +/- h, written so that it vectorizes
+                }
+                w = h;
+            }
 
-    boundary.center = mean_Y;
-    boundary.width  = width_Y;
-    boundary.n_dims = QT_NO_DIMS;
+            // Bit (code_levels - 1 - level) of bits goes to bit (code_levels - 1 - level) * no_dims + d
+            for (int j = 0; j < count; j++) {
+                code[j] |= spreadBits(bits[j], no_dims(), code_levels) << d;
+            }
+        }
+        for (int j = 0; j < count; j++) {
+            codes[n0 + j] = code[j];
+            order[n0 + j] = n0 + j;
+        }
+    }
+}
 
-    index[0] = 0;
 
-    center_of_mass = new float[QT_NO_DIMS];
-    for (int i = 0; i < QT_NO_DIMS; i++) {
-        center_of_mass[i] = .0;
+// Stable parallel LSD radix sort of (codes, order), one byte per pass
+template <int Dims>
+void SplitTree<Dims>::sortCodes(int N)
+{
+#ifdef _OPENMP
+    int max_threads = omp_get_max_threads();
+#else
+    int max_threads = 1;
+#endif
+    histogram.resize(max_threads * 256);
+
+    for (int shift = 0; shift < code_levels * no_dims(); shift += 8) {
+        bool skip = false;
+#ifdef _OPENMP
+        #pragma omp parallel num_threads(max_threads)
+#endif
+        {
+#ifdef _OPENMP
+            int t = omp_get_thread_num(), nt = omp_get_num_threads();
+#else
+            int t = 0, nt = 1;
+#endif
+            int lo = (long long) N * t / nt;
+            int hi = (long long) N * (t + 1) / nt;
+            int* h = &histogram[t * 256];
+            for (int b = 0; b < 256; b++) h[b] = 0;
+            for (int i = lo; i < hi; i++) h[(codes[i] >> shift) & 255]++;
+#ifdef _OPENMP
+            #pragma omp barrier
+            #pragma omp single
+#endif
+            {
+                // Bucket offsets in (byte, thread) order keep the sort stable
+                // (a pass where every code has the same byte is skipped)
+                int sum = 0;
+                for (int b = 0; b < 256; b++) {
+                    int bucket_start = sum;
+                    for (int tt = 0; tt < nt; tt++) {
+                        int count = histogram[tt * 256 + b];
+                        histogram[tt * 256 + b] = sum;
+                        sum += count;
+                    }
+                    if (sum - bucket_start == N) skip = true;
+                }
+            }
+            if (!skip) {
+                for (int i = lo; i < hi; i++) {
+                    int pos = h[(codes[i] >> shift) & 255]++;
+                    codes_tmp[pos] = codes[i];
+                    order_tmp[pos] = order[i];
+                }
+            }
+        }
+        if (!skip) {
+            codes.swap(codes_tmp);
+            order.swap(order_tmp);
+        }
     }
 }
 
 
-// Destructor for SplitTree
-SplitTree::~SplitTree()
+// Create the children of a cell and hand each one its slice of the sorted points
+template <int Dims>
+void SplitTree<Dims>::splitMorton(int node, int level)
 {
-    for(unsigned int i = 0; i != children.size(); i++) {
-        delete children[i];
+    int first = nodes[node].children;
+    for (int i = 0; i < num_children(); ++i) {
+        float* child_center = center(first + i);
+        float* child_width = width(first + i);
+        for (int d = 0; d < no_dims(); d++) {
+            float h = .5f * width(node)[d];
+            child_center[d] = ((i >> d) & 1) ? center(node)[d] + h : center(node)[d] - h;
+            child_width[d] = h;
+        }
+        nodes[first + i].max_width = .5 * nodes[node].max_width;
+    }
+
+    int begin = nodes[node].begin;
+    int end = begin + nodes[node].cum_size;
+    if (level < code_levels) {
+
+        // Within a cell the digit of this level is non-decreasing, so each child is found by binary search
+        int shift = (code_levels - 1 - level) * no_dims();
+        uint64_t mask = num_children() - 1;
+        int lo = begin;
+        for (int i = 0; i < num_children(); ++i) {
+            int a = lo, b = end;
+            while (a < b) {
+                int m = a + (b - a) / 2;
+                if (((codes[m] >> shift) & mask) <= (uint64_t) i) a = m + 1;
+                else b = m;
+            }
+            makeCell(first + i, lo, a - lo, level + 1);
+            lo = a;
+        }
+    }
+    else {
+
+        // The codes are exhausted (all points here share one): partition by comparing with the cell center
+        const float* c = center(node);
+        int k = begin;
+        for (int i = 0; i < num_children(); ++i) {
+            int lo = k;
+            for (int j = begin; j < end; j++) {
+                const float* point = data + order[j];
+                int child = 0;
+                for (int d = 0; d < no_dims(); d++) {
+                    if (point[d * data_stride] > c[d]) child |= 1 << d;
+                }
+                if (child == i) order_tmp[k++] = order[j];
+            }
+            makeCell(first + i, lo, k - lo, level + 1);
+        }
+        std::copy(order_tmp.begin() + begin, order_tmp.begin() + end, order.begin() + begin);
     }
-    delete[] center_of_mass;
 }
 
 
-// Insert a point into the SplitTree
-bool SplitTree::insert(int new_index)
+// Initialize a cell covering order[begin, begin + count). A cell whose points all coincide is a leaf,
+// and so is any cell at QT_MAX_DEPTH.
+template <int Dims>
+void SplitTree<Dims>::makeCell(int node, int begin, int count, int level)
 {
-    // Ignore objects which do not belong in this quad tree
-    float* point = data + new_index * QT_NO_DIMS;
-    if (!boundary.containsPoint(point)) {
-        return false;
+    Node& n = nodes[node];
+    n.children = -1;
+    n.cum_size = count;
+    n.begin = begin;
+    n.index = -1;
+    if (count == 0) {
+        return;
     }
 
-    // Online update of cumulative size and center-of-mass
-    cum_size++;
-    float mult1 = (float) (cum_size - 1) / (float) cum_size;
-    float mult2 = 1.0 / (float) cum_size;
-    for (int d = 0; d < QT_NO_DIMS; d++) {
-        center_of_mass[d] = center_of_mass[d] * mult1 + mult2 * point[d];
+    // Identical points have identical codes, so only ranges with a single code need the full check
+    const float* point = data + order[begin];
+    bool identical = true;
+    if (count > 1 && (level >= code_levels || codes[begin] == codes[begin + count - 1])) {
+        for (int j = begin + 1; j < begin + count && identical; j++) {
+            const float* other = data + order[j];
+            for (int d = 0; d < no_dims(); d++) {
+                if (point[d * data_stride] != other[d * data_stride]) { identical = false; break; }
+            }
+        }
     }
-
-    // If there is space in this quad tree and it is a leaf, add the object here
-    if (is_leaf && size < QT_NODE_CAPACITY) {
-        index[size] = new_index;
-        size++;
-        return true;
+    else if (count > 1) {
+        identical = false;
     }
 
-    // Don't add duplicates for now (this is not very nice)
-    bool any_duplicate = false;
-    for (int n = 0; n < size; n++) {
-        bool duplicate = true;
-        for (int d = 0; d < QT_NO_DIMS; d++) {
-            if (point[d] != data[index[n] * QT_NO_DIMS + d]) { duplicate = false; break; }
+    float* com = center_of_mass(node);
+    if (identical) {
+        n.index = order[begin];
+        for (int d = 0; d < no_dims(); d++) {
+            com[d] = point[d * data_stride];
         }
-        any_duplicate = any_duplicate | duplicate;
     }
-    if (any_duplicate) {
-        return true;
+    else if (level == QT_MAX_DEPTH) {
+        n.index = order[begin];
+        for (int d = 0; d < no_dims(); d++) {
+            com[d] = .0;
+        }
+        for (int j = begin; j < begin + count; j++) {
+            for (int d = 0; d < no_dims(); d++) {
+                com[d] += data[d * data_stride + order[j]];
+            }
+        }
+        for (int d = 0; d < no_dims(); d++) {
+            com[d] /= (float) count;
+        }
     }
+}
+
 
-    // Otherwise, we need to subdivide the current cell
-    if (is_leaf) {
-        subdivide();
+// Exclusive prefix sum of a[0, n) in place; returns the total
+template <int Dims>
+int SplitTree<Dims>::exclusiveScan(int* a, int n)
+{
+#ifdef _OPENMP
+    int max_threads = omp_get_max_threads();
+#else
+    int max_threads = 1;
+#endif
+    if (max_threads == 1 || n < 4096) {
+        int sum = 0;
+        for (int i = 0; i < n; i++) {
+            int v = a[i];
+            a[i] = sum;
+            sum += v;
+        }
+        return sum;
     }
 
-    // Find out where the point can be inserted
-    for (int i = 0; i < num_children; ++i) {
-        if (children[i]->insert(new_index)) {
-            return true;
+    // Per-thread chunk sums, scanned serially, then each chunk is scanned from its offset
+    histogram.resize(std::max((int) histogram.size(), max_threads + 1));
+    int* partial = &histogram[0];
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(max_threads)
+#endif
+    {
+#ifdef _OPENMP
+        int t = omp_get_thread_num(), nt = omp_get_num_threads();
+#else
+        int t = 0, nt = 1;
+#endif
+        int lo = (long long) n * t / nt;
+        int hi = (long long) n * (t + 1) / nt;
+        int sum = 0;
+        for (int i = lo; i < hi; i++) sum += a[i];
+        partial[t + 1] = sum;
+#ifdef _OPENMP
+        #pragma omp barrier
+        #pragma omp single
+#endif
+        {
+            partial[0] = 0;
+            for (int tt = 0; tt < nt; tt++) partial[tt + 1] += partial[tt];
+        }
+        sum = partial[t];
+        for (int i = lo; i < hi; i++) {
+            int v = a[i];
+            a[i] = sum;
+            sum += v;
         }
     }
+    return partial[max_threads];
+}
+
+
+// Insert a point into the SplitTree, descending from the root
+template <int Dims>
+void SplitTree<Dims>::insert(int new_index)
+{
+    const float* point = data + new_index;
+    int node = 0;
+    for (int depth = 0; ; depth++) {
+
+        // Online update of cumulative size and center-of-mass
+        int cum_size = ++nodes[node].cum_size;
+        float mult1 = (float) (cum_size - 1) / (float) cum_size;
+        float mult2 = 1.0 / (float) cum_size;
+        float* com = center_of_mass(node);
+        for (int d = 0; d < no_dims(); d++) {
+            com[d] = com[d] * mult1 + mult2 * point[d * data_stride];
+        }
+
+        if (nodes[node].children == -1) {
 
-    // Otherwise, the point cannot be inserted (this should never happen)
-    // printf("%s\n", "No no, this should not happen");
-    return false;
+            // If this leaf is empty, add the object here
+            int index = nodes[node].index;
+            if (index == -1) {
+                nodes[node].index = new_index;
+                return;
+            }
+
+            // Don't add duplicates for now (this is not very nice)
+            bool duplicate = true;
+            for (int d = 0; d < no_dims(); d++) {
+                if (point[d * data_stride] != data[d * data_stride + index]) { duplicate = false; break; }
+            }
+            // (past QT_MAX_DEPTH, distinct points that have not been separated are folded in as well)
+            if (duplicate || depth == QT_MAX_DEPTH) {
+                dup_next[new_index] = dup_next[index];
+                dup_next[index] = new_index;
+                return;
+            }
+
+            // Otherwise, we need to subdivide the current cell
+            subdivide(node);
+        }
+
+        // Descend into the child whose cell contains the point
+        const float* c = center(node);
+        int child = 0;
+        for (int d = 0; d < no_dims(); d++) {
+            if (point[d * data_stride] > c[d]) child |= 1 << d;
+        }
+        node = nodes[node].children + child;
+    }
 }
 
-int *get_bits(int n, int bitswanted){
-  int *bits = new int[bitswanted];
 
-  int k;
-  for(k=0; k<bitswanted; k++) {
-    int mask =  1 << k;
-    int masked_n = n & mask;
-    int thebit = masked_n >> k;
-    bits[k] = thebit;
-  }
+// Create children which fully divide this cell into quads of equal area, and move the stored point down
+template <int Dims>
+void SplitTree<Dims>::subdivide(int node)
+{
+    int first = newNodes(num_children());
+    nodes[node].children = first;
+
+    for (int i = 0; i < num_children(); ++i) {
+        // bit d of i selects the lower or upper half along dimension d
+        float* child_center = center(first + i);
+        float* child_width = width(first + i);
+        for (int d = 0; d < no_dims(); d++) {
+            float h = .5f * width(node)[d];
+            child_center[d] = ((i >> d) & 1) ? center(node)[d] + h : center(node)[d] - h;
+            child_width[d] = h;
+        }
+        nodes[first + i].max_width = .5 * nodes[node].max_width;
+    }
+
+    // Move the existing point (and the duplicates folded into it) to the correct child.
+    // The point being inserted has already been counted in this node, hence cum_size - 1.
+    int index = nodes[node].index;
+    const float* point = data + index;
+    int child = 0;
+    for (int d = 0; d < no_dims(); d++) {
+        if (point[d * data_stride] > center(node)[d]) child |= 1 << d;
+    }
+    nodes[first + child].index = index;
+    nodes[first + child].cum_size = nodes[node].cum_size - 1;
+    float* com = center_of_mass(first + child);
+    for (int d = 0; d < no_dims(); d++) {
+        com[d] = point[d * data_stride];
+    }
 
-  return bits;
+    // This node is not leaf now
+    nodes[node].index = -1;
 }
 
-// Create four children which fully divide this cell into four quads of equal area
-void SplitTree::subdivide() {
 
-    // Create children
-    float* new_centers = new float[2 * QT_NO_DIMS];
-    for(int i = 0; i < QT_NO_DIMS; ++i) {
-        new_centers[i*2]     = boundary.center[i] - .5 * boundary.width[i];
-        new_centers[i*2 + 1] = boundary.center[i] + .5 * boundary.width[i];
+// Compute non-edge forces using Barnes-Hut algorithm, for a batch of up to QT_BATCH_SIZE points that
+// share one traversal. The theta criterion is still tested per point: a stack entry carries the mask
+// of points that have to visit the children of a node, and each point sees the same cells in the same
+// order as it would on its own. Forces for the k-th point are added to neg_f[d * neg_f_stride + k] and
+// sum_Q[k]; both must have room for QT_BATCH_SIZE points.
+template <int Dims>
+void SplitTree<Dims>::computeNonEdgeForces(const int* point_indices, int count, float theta, float* neg_f, int neg_f_stride, float* sum_Q) const
+{
+    // Unused lanes repeat the first point with an empty mask, so the lane loops need no bounds checks
+    const int B = QT_BATCH_SIZE;
+    const float* point[B];
+    int index[B];
+    for (int k = 0; k < B; k++) {
+        index[k] = k < count ? point_indices[k] : -1;
+        point[k] = data + (k < count ? point_indices[k] : point_indices[0]);
     }
+    computeForces(point, data_stride, index, count, theta, neg_f, neg_f_stride, sum_Q);
+}
 
-    for (int i = 0; i < num_children; ++i) {
-        int *bits = get_bits(i, QT_NO_DIMS);
 
-        float* mean_Y = new float[QT_NO_DIMS];
-        float* width_Y = new float[QT_NO_DIMS];
+// The same for a batch of up to QT_BATCH_SIZE positions that are not points of the tree, stored as
+// planes of query_stride floats: the forces of the tree's points on them
+template <int Dims>
+void SplitTree<Dims>::computeQueryForces(const float* queries, int query_stride, int count, float theta, float* neg_f, int neg_f_stride, float* sum_Q) const
+{
+    const int B = QT_BATCH_SIZE;
+    const float* point[B];
+    int index[B];
+    for (int k = 0; k < B; k++) {
+        index[k] = -1;
+        point[k] = queries + (k < count ? k : 0);
+    }
+    computeForces(point, query_stride, index, count, theta, neg_f, neg_f_stride, sum_Q);
+}
 
-        // fill the means and width
-        for (int d = 0; d < QT_NO_DIMS; d++) {
-            mean_Y[d] = new_centers[d*2 + bits[d]];
-            width_Y[d] = .5*boundary.width[d];
+
+// The traversal of a batch: coordinate d of the k-th point at point[k][d * point_stride], which is
+// excluded from the leaf holding point index[k]
+template <int Dims>
+void SplitTree<Dims>::computeForces(const float* const* point, int point_stride, const int* index, int count, float theta, float* neg_f, int neg_f_stride, float* sum_Q) const
+{
+    const int B = QT_BATCH_SIZE;
+
+    // Explicit stack: each entry walks the children [next, end) of one node, so it is never deeper
+    // than the tree. The root is visited by every point.
+    struct Frame { int next; int end; uint32_t mask; };
+    Frame stack[QT_MAX_DEPTH + 2];
+    int top = 0;
+    stack[0].next = 0;
+    stack[0].end = 1;
+    stack[0].mask = (1u << count) - 1;
+
+    while (top >= 0) {
+        int node = stack[top].next++;
+        uint32_t mask = stack[top].mask;
+        if (stack[top].next == stack[top].end) {
+            top--;
         }
 
-        SplitTree* qt = new SplitTree(this, data, mean_Y, width_Y);
-        children.push_back(qt);
-        delete[] bits;
-    }
-    delete[] new_centers;
+        // Make sure that we spend no time on empty nodes
+        const Node& n = nodes[node];
+        if (n.cum_size == 0) {
+            continue;
+        }
+
+        const float* com = center_of_mass(node);
+        bool is_leaf = n.children == -1;
+        float cum_size = n.cum_size;
+        uint32_t open = 0;
+        for (int k = 0; k < B; k++) {
+
+            // Compute distance between point and center-of-mass
+            float D = .0;
+            for (int d = 0; d < no_dims(); d++) {
+                float t = point[k][d * point_stride] - com[d];
+                D += t * t;
+            }
 
-    // Move existing points to correct children
-    for (int i = 0; i < size; i++) {
-        // bool flag = false;
-        for (int j = 0; j < num_children; j++) {
-            if (children[j]->insert(index[i])) {
-                // flag = true;
-                break;
+            // Use this node as a "summary" if it is a leaf (other than the point itself) or far enough away
+            bool active = (mask >> k) & 1;
+            bool summary = is_leaf || n.max_width / sqrtf(D) < theta;
+            bool self = is_leaf && n.index == index[k];
+            float use = (active && summary && !self) ? 1.0f : .0f;
+            open |= (uint32_t) (active && !summary) << k;
+
+            // Compute and add t-SNE force between point and current node
+            float Q = 1.0f / (1.0f + D);
+            float mult = use * cum_size * Q * Q;
+            sum_Q[k] += use * cum_size * Q;
+            for (int d = 0; d < no_dims(); d++) {
+                neg_f[d * neg_f_stride + k] += mult * (point[k][d * point_stride] - com[d]);
             }
         }
-        // if (flag == false) {
-        index[i] = -1;
-        // }
-    }
 
-    // This node is not leaf now
-    // Empty it
-    size = 0;
-    is_leaf = false;
+        // Points for which this node is too close descend into its children
+        if (open != 0) {
+            top++;
+            stack[top].next = n.children;
+            stack[top].end = n.children + num_children();
+            stack[top].mask = open;
+        }
+    }
 }
 
 
-// Build SplitTree on dataset
-void SplitTree::fill(int N)
+// Compute non-edge forces for all points with the dual-tree variant of Barnes-Hut: two cells interact
+// as a whole when (max_width(target) + max_width(source)) / distance < theta, which for a target cell of
+// a single point is the criterion of computeNonEdgeForces. Each target cell collects a first-order
+// expansion of the force around its center of mass, which is shifted down to its points at the end.
+// Results are written (not added) to neg_f (planes of neg_f_stride) in point order, and to sum_Q in
+// tree order.
+template <int Dims>
+void SplitTree<Dims>::computeDualTreeForces(float theta, float* neg_f, int neg_f_stride, float* sum_Q)
 {
-    for (int i = 0; i < N; i++) {
-        insert(i);
+#ifdef _OPENMP
+    int max_threads = omp_get_max_threads();
+#else
+    int max_threads = 1;
+#endif
+    node_force.resize(nodes.size() * expansion_size());
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < (int) node_force.size(); i++) {
+        node_force[i] = .0;
+    }
+
+    // Cut the tree into disjoint target subtrees. Each one only ever writes to its own nodes and points,
+    // so the subtrees are processed in parallel, each against the whole tree as the source.
+    int N = nodes[0].cum_size;
+    int grain = std::max(N / (16 * max_threads), 1024);
+    dual_targets.clear();
+    struct Frame { int next; int end; };
+    Frame stack[QT_MAX_DEPTH + 2];
+    int top = 0;
+    stack[0].next = 0;
+    stack[0].end = 1;
+    while (top >= 0) {
+        int node = stack[top].next++;
+        if (stack[top].next == stack[top].end) {
+            top--;
+        }
+        if (nodes[node].cum_size == 0) {
+            continue;
+        }
+        if (nodes[node].children == -1 || nodes[node].cum_size <= grain) {
+            dual_targets.push_back(node);
+        }
+        else {
+            top++;
+            stack[top].next = nodes[node].children;
+            stack[top].end = nodes[node].children + num_children();
+        }
+    }
+
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1)
+#endif
+    for (int i = 0; i < (int) dual_targets.size(); i++) {
+        interact(dual_targets[i], 0, theta);
+        pushDown(dual_targets[i], neg_f, neg_f_stride, sum_Q);
     }
 }
 
-// [YY]: can parallelize by spawing new threads on tree edges (the last loop)
-// Compute non-edge forces using Barnes-Hut algorithm
-void SplitTree::computeNonEdgeForces(int point_index, float theta, float* neg_f, float* sum_Q)
+
+// Add the repulsion of the points in source to every point in target (both non-empty), splitting the
+// larger cell until the pair is well separated or both cells are leaves.
+// With r = com(target) - com(source), q = 1 / (1 + |r|^2) and m = cum_size(source), the target collects
+// the force m q^2 r, its Jacobian m (q^2 I - 4 q^3 r r^T) and Q = m q (whose gradient is -2 times the force).
+template <int Dims>
+void SplitTree<Dims>::interact(int target, int source, float theta)
 {
-    // Make sure that we spend no time on empty nodes or self-interactions
-    if (cum_size == 0 || (is_leaf && size == 1 && index[0] == point_index)) {
+    const Node& t = nodes[target];
+    const Node& s = nodes[source];
+    bool target_leaf = t.children == -1;
+    bool source_leaf = s.children == -1;
+    if (target_leaf && target == source) {
         return;
     }
-    // Compute distance between point and center-of-mass
+
+    const float* t_com = center_of_mass(target);
+    const float* s_com = center_of_mass(source);
     float D = .0;
-    int ind = point_index * QT_NO_DIMS;
+    for (int d = 0; d < no_dims(); d++) {
+        float r = t_com[d] - s_com[d];
+        D += r * r;
+    }
 
-    for (int d = 0; d < QT_NO_DIMS; d++) {
-        float t  = data[ind + d] - center_of_mass[d];
-        D += t * t;
+    // The points of a leaf coincide, so a leaf has no extent
+    float t_width = target_leaf ? .0f : t.max_width;
+    float s_width = source_leaf ? .0f : s.max_width;
+    if ((target_leaf && source_leaf) || (t_width + s_width) / sqrtf(D) < theta) {
+        float Q = 1.0f / (1.0f + D);
+        float mQ = s.cum_size * Q;
+        float mQ2 = mQ * Q;
+        float* f = &node_force[target * expansion_size()];
+        for (int d = 0; d < no_dims(); d++) {
+            f[d] += mQ2 * (t_com[d] - s_com[d]);
+        }
+        f[no_dims()] += mQ;
+
+        // (the Jacobian of a leaf is never needed)
+        if (!target_leaf) {
+            float mQ3 = -4.0f * mQ2 * Q;
+            float* J = f + no_dims() + 1;
+            for (int d = 0; d < no_dims(); d++) {
+                for (int e = 0; e < no_dims(); e++) {
+                    J[d * no_dims() + e] += mQ3 * (t_com[d] - s_com[d]) * (t_com[e] - s_com[e]);
+                }
+                J[d * no_dims() + d] += mQ2;
+            }
+        }
+        return;
     }
 
-    // Check whether we can use this node as a "summary"
-    float m = -1;
-    for (int i = 0; i < QT_NO_DIMS; ++i) {
-        m = max(m, boundary.width[i]);
+    if (target_leaf || (!source_leaf && s.max_width >= t.max_width)) {
+        for (int i = s.children; i < s.children + num_children(); i++) {
+            if (nodes[i].cum_size > 0) interact(target, i, theta);
+        }
     }
-    if (is_leaf || m / sqrt(D) < theta) {
+    else {
+        for (int i = t.children; i < t.children + num_children(); i++) {
+            if (nodes[i].cum_size > 0) interact(i, source, theta);
+        }
+    }
+}
 
-        // Compute and add t-SNE force between point and current node
-        float Q = 1.0 / (1.0 + D);
-        float mult = cum_size * Q * Q;
 
-        *sum_Q += cum_size * Q;
-        for (int d = 0; d < QT_NO_DIMS; d++) {
-            neg_f[d] += mult * (data[ind + d] - center_of_mass[d]);
+// Shift the expansion of a node to position p (coordinates p_stride apart), adding the force to out_f
+// (out_stride apart) and returning Q there
+template <int Dims>
+float SplitTree<Dims>::evaluateExpansion(int node, const float* p, int p_stride, float* out_f, int out_stride) const
+{
+    const float* f = &node_force[node * expansion_size()];
+    const float* J = f + no_dims() + 1;
+    const float* com = center_of_mass(node);
+    float Q = f[no_dims()];
+    for (int d = 0; d < no_dims(); d++) {
+        float s = p[d * p_stride] - com[d];
+        Q -= 2.0f * f[d] * s;
+        for (int e = 0; e < no_dims(); e++) {
+            out_f[e * out_stride] += J[e * no_dims() + d] * s;
         }
     }
-    else {
-        // Recursively apply Barnes-Hut to children
-        for (int i = 0; i < num_children; ++i) {
-            children[i]->computeNonEdgeForces(point_index, theta, neg_f, sum_Q);
+    for (int d = 0; d < no_dims(); d++) {
+        out_f[d * out_stride] += f[d];
+    }
+    return Q;
+}
+
+
+// Translate the expansions of a target subtree from the top down, and evaluate them at the points
+template <int Dims>
+void SplitTree<Dims>::pushDown(int target, float* neg_f, int neg_f_stride, float* sum_Q)
+{
+    const int size = expansion_size();
+    struct Frame { int next; int end; int parent; };
+    Frame stack[QT_MAX_DEPTH + 2];
+    int top = 0;
+    stack[0].next = target;
+    stack[0].end = target + 1;
+    stack[0].parent = -1;
+    while (top >= 0) {
+        int node = stack[top].next++;
+        int parent = stack[top].parent;
+        if (stack[top].next == stack[top].end) {
+            top--;
+        }
+        const Node& n = nodes[node];
+        if (n.cum_size == 0) {
+            continue;
+        }
+
+        // The Jacobian carries over unchanged, the force and Q are shifted to the center of mass of the child
+        if (parent != -1) {
+            float* f = &node_force[node * size];
+            const float* parent_f = &node_force[parent * size];
+            for (int d = no_dims() + 1; d < size; d++) {
+                f[d] += parent_f[d];
+            }
+            f[no_dims()] += evaluateExpansion(parent, center_of_mass(node), 1, f, 1);
+        }
+
+        if (n.children != -1) {
+            top++;
+            stack[top].next = n.children;
+            stack[top].end = n.children + num_children();
+            stack[top].parent = node;
+        }
+        else {
+            for (int i = n.begin; i < n.begin + n.cum_size; i++) {
+                for (int d = 0; d < no_dims(); d++) {
+                    neg_f[d * neg_f_stride + order[i]] = .0;
+                }
+                sum_Q[i] = evaluateExpansion(node, data + order[i], data_stride, neg_f + order[i], neg_f_stride);
+            }
         }
     }
 }
+
+
+template class SplitTree<0>;
+template class SplitTree<2>;
+template class SplitTree<3>;
@@ -10,64 +10,136 @@
 
 #include <cstdlib>
 #include <vector>
+#include <stdint.h>
 
 #ifndef SPLITTREE_H
-#define SPLITREE_H
+#define SPLITTREE_H
 
 static inline float min(float x, float y) { return (x <= y ? x : y); }
 static inline float max(float x, float y) { return (x <= y ? y : x); }
 static inline float abs_d(float x) { return (x <= 0 ? -x : x); }
 
-class Cell {
 
+/*
+    Flat SplitTree: all nodes live in one contiguous array and refer to their children by index.
+    The children of a node are allocated together, so a node only stores the index of the first one.
+    Both arrays are cleared, not freed, on rebuild, so a tree that is rebuilt every iteration stops
+    allocating once it has reached its working size.
+
+    Points are read from no_dims planes of data_stride floats each (coordinate d of point i is at
+    data[d * data_stride + i]), and forces are written in the same layout.
+
+    Dims fixes the number of dimensions at compile time (SplitTree<2>, SplitTree<3>), which unrolls
+    every per-dimension loop and stores the node geometry (center, half-width, center of mass) inline
+    in the node. SplitTree<0> takes the dimensionality at runtime and keeps the geometry in a second
+    array with a stride of 3 * no_dims floats.
+
+    Two build modes produce the same cells:
+        BUILD_INSERT -- insert the points one at a time (serial)
+        BUILD_MORTON -- sort the points by Morton (Z-order) code with a parallel radix sort, then emit
+                        the tree level by level from the sorted ranges.
+    Either way every node covers the range order[begin, begin + cum_size) of the points in tree order.
+
+    Repulsive forces come either from computeNonEdgeForces (point-cell Barnes-Hut, one traversal per
+    batch of points) or from computeDualTreeForces (cell-cell, for all points at once). computeQueryForces
+    is the point-cell variant for positions outside the tree, whose points then stay fixed.
+*/
+// Common base, so that trees of any dimensionality can be owned through one pointer
+class SplitTreeBase
+{
 public:
-	float* center;
-	float* width;
-	int n_dims;
-	bool   containsPoint(float point[]);
-	~Cell() {
-		delete[] center;
-		delete[] width;
-	}
+	virtual ~SplitTreeBase() {}
 };
 
 
-class SplitTree
+template <int Dims>
+class SplitTree : public SplitTreeBase
 {
+	// Fixed constants: cells this deep are not split any further
+	static const int QT_MAX_DEPTH = 64;
+	// Points per block of the sums of the map, which are added in block order
+	static const int QT_SUM_BLOCK = 4096;
 
-	// Fixed constants
-	static const int QT_NODE_CAPACITY = 1;
+public:
+	enum BuildMode { BUILD_INSERT, BUILD_MORTON };
 
-	// Properties of this node in the tree
-	int QT_NO_DIMS;
-	bool is_leaf;
-	int size;
-	int cum_size;
+	// Number of points that share one Barnes-Hut traversal
+	static const int QT_BATCH_SIZE = 8;
 
-	// Axis-aligned bounding box stored as a center with half-dimensions to represent the boundaries of this quad tree
-	Cell boundary;
+private:
+	struct Node {
+		int children;           // index of the first of num_children contiguous children, -1 for a leaf
+		int cum_size;           // number of points in this cell (duplicates included)
+		int index;              // point stored in a leaf, -1 for an empty leaf
+		int begin;              // first entry of this cell in order
+		float max_width;        // largest half-width over all dimensions
+		float geometry[Dims > 0 ? 3 * Dims : 1];    // center, half-width, center of mass (Dims > 0)
+	};
+
+	int QT_NO_DIMS;
+	BuildMode build_mode;
 
-	// Indices in this quad tree node, corresponding center-of-mass, and list of all children
 	float* data;
-	float* center_of_mass;
-	int index[QT_NODE_CAPACITY];
+	int data_stride;
+	std::vector<Node> nodes;
+	std::vector<float> node_data;
 
-	int num_children;
-	std::vector<SplitTree*> children;
-public:
+	// Morton build buffers, kept between rebuilds
+	int code_levels;
+	std::vector<uint64_t> codes, codes_tmp;
+	std::vector<int> order, order_tmp;            // order is filled by both build modes
+	std::vector<int> child_offset;
+	std::vector<int> level_start;
+	std::vector<int> histogram;
+
+	// Per block and dimension, the sum of the coordinates (for the mean of the map)
+	std::vector<float> block_sums;
+
+	// BUILD_INSERT: points folded into a leaf, chained from the point stored in the leaf
+	std::vector<int> dup_next;
 
+	// Dual-tree buffers: per node, the force, Q and the no_dims x no_dims force Jacobian at its center of
+	// mass (expansion_size() floats); and the roots of the target subtrees
+	std::vector<float> node_force;
+	std::vector<int> dual_targets;
 
-	SplitTree(float* inp_data, int N, int no_dims);
-	SplitTree(SplitTree* inp_parent, float* inp_data, float* mean_Y, float* width_Y);
-	~SplitTree();
-	void construct(Cell boundary);
-	bool insert(int new_index);
-	void subdivide();
-	void computeNonEdgeForces(int point_index, float theta, float* neg_f, float* sum_Q);
+public:
+	SplitTree(float* inp_data, int inp_stride, int N, int inp_no_dims, BuildMode mode = BUILD_MORTON);
+	void rebuild(float* inp_data, int inp_stride, int N);
+	void computeNonEdgeForces(const int* point_indices, int count, float theta, float* neg_f, int neg_f_stride, float* sum_Q) const;
+	void computeQueryForces(const float* queries, int query_stride, int count, float theta, float* neg_f, int neg_f_stride, float* sum_Q) const;
+	void computeDualTreeForces(float theta, float* neg_f, int neg_f_stride, float* sum_Q);
+
+	// Points in tree order: consecutive points are spatially adjacent
+	const int* pointOrder() const { return &order[0]; }
 private:
 
-	void init(SplitTree* inp_parent, float* inp_data, float* mean_Y, float* width_Y);
+	int no_dims() const { return Dims > 0 ? Dims : QT_NO_DIMS; }
+	int num_children() const { return 1 << no_dims(); }
+	int expansion_size() const { return no_dims() + 1 + no_dims() * no_dims(); }
+
+	float* geometry(int node) { return Dims > 0 ? nodes[node].geometry : &node_data[node * 3 * no_dims()]; }
+	const float* geometry(int node) const { return Dims > 0 ? nodes[node].geometry : &node_data[node * 3 * no_dims()]; }
+	float* center(int node) { return geometry(node); }
+	float* width(int node) { return geometry(node) + no_dims(); }
+	float* center_of_mass(int node) { return geometry(node) + 2 * no_dims(); }
+	const float* center_of_mass(int node) const { return geometry(node) + 2 * no_dims(); }
+
+	int newNodes(int count);
+	void computeBoundary(int N);
 	void fill(int N);
+	void fillMorton(int N);
+	void computeCodes(int N);
+	void sortCodes(int N);
+	void splitMorton(int node, int level);
+	void makeCell(int node, int begin, int count, int level);
+	int exclusiveScan(int* a, int n);
+	void insert(int new_index);
+	void subdivide(int node);
+	void computeForces(const float* const* point, int point_stride, const int* index, int count, float theta, float* neg_f, int neg_f_stride, float* sum_Q) const;
+	void interact(int target, int source, float theta);
+	void pushDown(int target, float* neg_f, int neg_f_stride, float* sum_Q);
+	float evaluateExpansion(int node, const float* p, int p_stride, float* out_f, int out_stride) const;
 };
 
 #endif
@@ -16,6 +16,7 @@
 #include <ctime>
 #include <iostream>
 #include <chrono>
+#include <algorithm>
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -24,7 +25,14 @@
 
 #include "tsne.h"
 #include "vptree.h"
+#include "knn.h"
+#include "blockedknn.h"
+#include "similaritycache.h"
+#include "checkpoint.h"
+#include "perplexity.h"
+#include "inputfile.h"
 #include "splittree.h"
+#include "fftrepulsion.h"
 
 using namespace std::chrono;
 typedef std::chrono::high_resolution_clock Clock;
@@ -38,169 +46,619 @@ typedef std::chrono::duration<float> dsec;
 #endif
 
 
+TSNE::TSNE() : repulsion(REPULSION_BARNES_HUT), knn(KNN_VPTREE), knn_trees(8), input(NULL), stream_buffer(0), edge_forces(NULL), tree(NULL), fft(NULL), plane_stride(0), Q(NULL), pos_f(NULL), neg_f(NULL), batch_f(NULL), batch_stride(0), block_sums(NULL), sum_Q(0) {
+    seedRandom(1);
+}
+
+TSNE::~TSNE() {
+    freeWorkspace();
+}
+
+
+// Allocate count floats aligned to a cache line
+static float* allocateAligned(size_t count)
+{
+    void* ptr;
+    if (posix_memalign(&ptr, 64, count * sizeof(float)) != 0) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+    return (float*) ptr;
+}
+
+
 /*
     Perform t-SNE
         X -- float matrix of size [N, D]
         D -- input dimensionality
         Y -- array to fill with the result of size [N, no_dims]
         no_dims -- target dimentionality
+        repulsion -- approximation of the repulsive forces (see RepulsionMethod)
+        knn -- search for the nearest neighbours of the input points (see KnnMethod)
+        knn_trees -- random projection trees of the approximate search, more for a higher recall
+        cache_dir -- directory of the input similarity cache (see SimilarityCache), or NULL not to cache
+        read_only_X -- do not normalize X in place (X is then never written to, and may be a read-only mapping)
+        input -- stream X from this file instead (X is then not used, and may be NULL): only the blocked
+                 nearest neighbour search streams, so it is used whatever knn is, and nothing is cached
+        stream_buffer -- bytes of input rows (and their kNN candidates) in memory at a time when streaming
+        keep_index -- (sessions only) keep an index of the input points for TSNESession::transform
+        checkpoint -- path of the checkpoint files (see Checkpoint), or NULL not to checkpoint
+        checkpoint_interval -- iterations between checkpoints
+        resume -- (TSNE::optimize only) resume from the checkpoint instead of starting: the session must be
+                  the one of the checkpoint (see TSNESession::fromCheckpoint), and the schedule and its
+                  parameters are those saved (only max_iter, verbose and the checkpoints are taken from
+                  the call)
+
+    This is a TSNESession (step 1) and one optimization on it (step 2).
 */
 void TSNE::run(float* X, int N, int D, float* Y,
                int no_dims, float perplexity, float theta ,
                int num_threads, int max_iter, int n_iter_early_exag,
                int random_state, bool init_from_Y, int verbose,
                float early_exaggeration, float learning_rate,
-               float *final_error) {
+               float *final_error, RepulsionMethod inp_repulsion,
+               KnnMethod inp_knn, int inp_knn_trees, const char* cache_dir, bool read_only_X,
+               InputFile* inp_input, size_t inp_stream_buffer, const char* checkpoint, int checkpoint_interval) {
+
+    TSNESession session(X, N, D, perplexity, num_threads, verbose, inp_knn, inp_knn_trees, cache_dir, read_only_X,
+                        inp_input, inp_stream_buffer);
+    optimize(session, Y, no_dims, theta, num_threads, max_iter, n_iter_early_exag, random_state, init_from_Y,
+             verbose, early_exaggeration, learning_rate, final_error, inp_repulsion, checkpoint, checkpoint_interval);
+}
+
+
+/*
+    Step 1: compute the input similarities P (see TSNE::run for the parameters)
+*/
+TSNESession::TSNESession(float* X, int inp_N, int inp_D, float perplexity, int num_threads, int verbose,
+                         KnnMethod knn, int knn_trees, const char* cache_dir, bool read_only_X,
+                         InputFile* input, size_t stream_buffer, bool keep_index)
+    : N(inp_N), D(inp_D), row_P(NULL), col_P(NULL), val_P(NULL), cache(NULL), source(NULL), mapped(false), x_mean(NULL),
+      x_scale(1), index(NULL), ref_dims(0), ref_stride(0), ref_Y(NULL), ref_tree(NULL) {
 
     if (N - 1 < 3 * perplexity) {
         perplexity = (N - 1) / 3;
         if (verbose)
             fprintf(stderr, "Perplexity too large for the number of data points! Adjusting ...\n");
     }
+    perp = perplexity;
 
 #ifdef _OPENMP
     omp_set_num_threads(NUM_THREADS(num_threads));
 #endif
 
-    /*
-        ======================
-            Step 1
-        ======================
-    */
-
-    if (verbose)
-        fprintf(stderr, "Using no_dims = %d, perplexity = %f, and theta = %f\n", no_dims, perplexity, theta);
-
-    // Set learning parameters
-    // set up timer
-    float compute_time = 0.;
-    int stop_lying_iter = n_iter_early_exag, mom_switch_iter = n_iter_early_exag;
-    float momentum = .5, final_momentum = .8;
-    float eta = learning_rate;
-
-    // Allocate some memory
-    float* dY    = (float*) malloc(N * no_dims * sizeof(float));
-    float* uY    = (float*) calloc(N * no_dims , sizeof(float));
-    float* gains = (float*) malloc(N * no_dims * sizeof(float));
-    if (dY == NULL || uY == NULL || gains == NULL) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
-    for (int i = 0; i < N * no_dims; i++) {
-        gains[i] = 1.0;
+    // The neighbour search is done by a TSNE object
+    TSNE search;
+    if (input != NULL) {
+        if (verbose && knn != KNN_BLOCKED && knn != KNN_AUTO)
+            fprintf(stderr, "Streaming the input: using the blocked nearest neighbour search.\n");
+        knn = KNN_BLOCKED;
+        if (verbose && cache_dir != NULL)
+            fprintf(stderr, "Streaming the input: the input similarities are not cached.\n");
+        cache_dir = NULL;
+        if (verbose && keep_index)
+            fprintf(stderr, "Streaming the input: no index is kept for transform.\n");
+        keep_index = false;
+    }
+    if (knn == KNN_AUTO) {
+        knn = preferBlockedKnn(N, D) ? KNN_BLOCKED : KNN_VPTREE;
     }
+    search.knn = knn;
+    search.knn_trees = knn_trees;
+    search.input = input;
+    search.stream_buffer = stream_buffer;
 
     // Normalize input data (to prevent numerical problems)
     if (verbose)
         fprintf(stderr, "Computing input similarities...\n");
 
+    // (a streamed X is normalized as its rows are read, to the same values; a read-only X is used as it
+    // is: the neighbours and P do not change under translation and uniform scaling of X, so this only
+    // guards the arithmetic against extreme values)
     auto compute_start = Clock::now();
-    zeroMean(X, N, D);
-    float max_X = .0;
-    for (int i = 0; i < N * D; i++) {
-        if (X[i] > max_X) max_X = X[i];
+    if (input != NULL) {
+        size_t chunk_rows = std::max<size_t>(stream_buffer / ((size_t) D * sizeof(float)), 1);
+        input->normalize((int) std::min<size_t>(chunk_rows, N));
     }
-    for (int i = 0; i < N * D; i++) {
-        X[i] /= max_X;
+    else if (!read_only_X) {
+        x_mean = (float*) malloc(D * sizeof(float));
+        if (x_mean == NULL) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+        search.zeroMean(X, N, D, x_mean);
+        float max_X = .0;
+        for (size_t i = 0; i < (size_t) N * D; i++) {
+            if (X[i] > max_X) max_X = X[i];
+        }
+        for (size_t i = 0; i < (size_t) N * D; i++) {
+            X[i] /= max_X;
+        }
+        x_scale = max_X;
     }
 
-    // Compute input similarities
-    int* row_P; int* col_P; float* val_P;
+    // Compute input similarities, unless they are in the cache
+    const int K = (int) (3 * perplexity);
+    if (cache_dir != NULL) {
+        cache = new SimilarityCache(cache_dir, X, N, D, perplexity, K, knn, knn == KNN_APPROXIMATE ? knn_trees : 0);
+        mapped = cache->load(&row_P, &col_P, &val_P);
+        if (verbose)
+            fprintf(stderr, "%s %s\n", mapped ? "Using cached input similarities from" : "Caching input similarities in", cache->path());
+    }
 
-    // Compute asymmetric pairwise input similarities
-    auto perplexity_start = Clock::now();
-    computeGaussianPerplexity(X, N, D, &row_P, &col_P, &val_P, perplexity, (int) (3 * perplexity), verbose);
-    float perplexity_time = duration_cast<dsec>(Clock::now() - perplexity_start).count();
-    if (verbose)
-        fprintf(stderr, "Computing asymmetric pairwise similarities takes %.4f\n", perplexity_time);
+    if (!mapped) {
+        // Compute asymmetric pairwise input similarities
+        auto perplexity_start = Clock::now();
+        search.computeGaussianPerplexity(X, N, D, &row_P, &col_P, &val_P, perplexity, K, verbose,
+                                         keep_index ? &index : NULL);
+        float perplexity_time = duration_cast<dsec>(Clock::now() - perplexity_start).count();
+        if (verbose)
+            fprintf(stderr, "Computing asymmetric pairwise similarities takes %.4f\n", perplexity_time);
+
+        // Symmetrize input similarities
+        auto symmetrize_start = Clock::now();
+        float sum_P = (float) search.symmetrizeMatrix(&row_P, &col_P, &val_P, N);
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (int64_t i = 0; i < row_P[N]; i++) {
+            val_P[i] /= sum_P;
+        }
+        float symmetrize_time = duration_cast<dsec>(Clock::now() - symmetrize_start).count();
+        if (verbose)
+            fprintf(stderr, "Symmetrization takes %.4f\n", symmetrize_time);
 
-    // Symmetrize input similarities
-    auto symmetrize_start = Clock::now();
-    symmetrizeMatrix(&row_P, &col_P, &val_P, N);
-    float sum_P = .0;
-    for (int i = 0; i < row_P[N]; i++) {
-        sum_P += val_P[i];
+        if (cache != NULL && !cache->save(row_P, col_P, val_P) && verbose)
+            fprintf(stderr, "Could not write %s\n", cache->path());
     }
-    for (int i = 0; i < row_P[N]; i++) {
-        val_P[i] /= sum_P;
+
+    // (the index of a search that did not use a VP tree is built here)
+    if (keep_index && index == NULL) {
+        index = new VpTree();
+        index->create(X, N, D);
     }
-    float symmetrize_time = duration_cast<dsec>(Clock::now() - symmetrize_start).count();
+
+    float compute_time = duration_cast<dsec>(Clock::now() - compute_start).count();
     if (verbose)
-        fprintf(stderr, "Symmetrization takes %.4f\n", symmetrize_time);
+        fprintf(stderr, "Done in %.4f seconds (sparsity = %f)!\n", compute_time, (float) row_P[N] / ((float) N * (float) N));
+}
+
+TSNESession::TSNESession()
+    : N(0), D(0), perp(0), row_P(NULL), col_P(NULL), val_P(NULL), cache(NULL), source(NULL), mapped(false), x_mean(NULL),
+      x_scale(1), index(NULL), ref_dims(0), ref_stride(0), ref_Y(NULL), ref_tree(NULL) {}
 
-    compute_time += duration_cast<dsec>(Clock::now() - compute_start).count();
+TSNESession* TSNESession::fromCheckpoint(const char* checkpoint, int verbose) {
+    TSNESession* session = new TSNESession();
+    session->source = new Checkpoint(checkpoint);
+    if (!session->source->loadSimilarities(&session->N, &session->row_P, &session->col_P, &session->val_P, &session->perp)) {
+        if (verbose)
+            fprintf(stderr, "Could not read the input similarities of %s\n", checkpoint);
+        delete session;
+        return NULL;
+    }
+    session->mapped = true;
     if (verbose)
-        fprintf(stderr, "Done in %.4f seconds (sparsity = %f)!\nLearning embedding...\n", compute_time, (float) row_P[N] / ((float) N * (float) N));
+        fprintf(stderr, "Using the input similarities of %s (N = %d)\n", checkpoint, session->N);
+    return session;
+}
 
-    /*
-        ======================
-            Step 2
-        ======================
-    */
+TSNESession::~TSNESession() {
+    // (mapped P is unmapped with the cache or the checkpoint)
+    if (!mapped) {
+        free(row_P);
+        free(col_P);
+        free(val_P);
+    }
+    delete cache;
+    delete source;
+    free(x_mean);
+    delete index;
+    free(ref_Y);
+    delete ref_tree;
+}
+
+
+// Run the optimizations in groups of threads: as many groups as runs (up to the number of threads), each
+// with an equal share of the threads for the parallel regions of its runs
+void TSNESession::optimize(TSNEOptimization* runs, int count, int num_threads) const {
+    int threads = NUM_THREADS(num_threads);
+    int groups = std::max(std::min(count, threads), 1);
+    int group_threads = std::max(threads / groups, 1);
+#ifdef _OPENMP
+    int max_levels = omp_get_max_active_levels();
+    omp_set_max_active_levels(2);
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(groups)
+#endif
+    for (int r = 0; r < count; r++) {
+        TSNEOptimization& run = runs[r];
+        TSNE tsne;
+        tsne.optimize(*this, run.Y, run.no_dims, run.theta, group_threads, run.max_iter, run.n_iter_early_exag,
+                      run.random_state, run.init_from_Y, run.verbose, run.early_exaggeration, run.learning_rate,
+                      &run.final_error, run.repulsion, run.checkpoint, run.checkpoint_interval, run.resume);
+    }
+#ifdef _OPENMP
+    omp_set_max_active_levels(max_levels);
+#endif
+}
+
+
+// Freeze a map of the points as the reference of transform: its planes and a tree over them
+void TSNESession::setReference(const float* Y, int no_dims) {
+    free(ref_Y);
+    delete ref_tree;
+    const int line = 64 / sizeof(float);
+    ref_dims = no_dims;
+    ref_stride = (N + line - 1) / line * line;
+    ref_Y = allocateAligned(no_dims * ref_stride);
+    for (int d = 0; d < no_dims; d++) {
+        for (int n = 0; n < ref_stride; n++) {
+            ref_Y[d * ref_stride + n] = n < N ? Y[(size_t) n * no_dims + d] : .0f;
+        }
+    }
+    switch (no_dims) {
+        case 2:  ref_tree = new SplitTree<2>(ref_Y, ref_stride, N, no_dims); break;
+        case 3:  ref_tree = new SplitTree<3>(ref_Y, ref_stride, N, no_dims); break;
+        default: ref_tree = new SplitTree<0>(ref_Y, ref_stride, N, no_dims); break;
+    }
+}
+
+
+// Place new points into a fixed map (see TSNESession::transform), by the similarities P to their K
+// neighbours in it. The new points do not interact, so each batch of them, which shares the Barnes-Hut
+// traversals, takes all its steps at once: the gradient of point i is
+//     sum_j p_j q_ij (y_i - y_j) - sum_j q_ij^2 (y_i - y_j) / sum_j q_ij,   q_ij = 1 / (1 + |y_i - y_j|^2)
+// (the first sum over the neighbours, the others over the whole map), that of the Kullback-Leibler
+// divergence of row i alone
+template <int Dims>
+static void placePoints(const SplitTree<Dims>* tree, const float* ref_Y, int ref_stride, int inp_no_dims,
+                        const int* neighbours, const float* P, int K, int M, float* Y,
+                        int max_iter, float theta, float learning_rate, float max_step)
+{
+    const int no_dims = Dims > 0 ? Dims : inp_no_dims;
+    const int B = SplitTree<Dims>::QT_BATCH_SIZE;
+    const float momentum = .5, final_momentum = .8;
+    int num_batches = (M + B - 1) / B;
+#ifdef _OPENMP
+    #pragma omp parallel
+#endif
+    {
+        // A batch as planes of B floats
+        std::vector<float> y(no_dims * B), uy(no_dims * B), gains(no_dims * B);
+        std::vector<float> pos_f(no_dims * B), neg_f(no_dims * B), sum_Q(B), coordinates(K);
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 1)
+#endif
+        for (int b = 0; b < num_batches; b++) {
+            int first = b * B;
+            int count = std::min(B, M - first);
+
+            // Start at rest, at the median of the neighbours (by coordinate)
+            std::fill(y.begin(), y.end(), .0f);
+            std::fill(uy.begin(), uy.end(), .0f);
+            std::fill(gains.begin(), gains.end(), 1.0f);
+            for (int k = 0; k < count; k++) {
+                const int* nb = neighbours + (size_t) (first + k) * K;
+                for (int d = 0; d < no_dims; d++) {
+                    for (int j = 0; j < K; j++) {
+                        coordinates[j] = ref_Y[d * ref_stride + nb[j]];
+                    }
+                    std::nth_element(coordinates.begin(), coordinates.begin() + K / 2, coordinates.end());
+                    y[d * B + k] = coordinates[K / 2];
+                }
+            }
+
+            for (int iter = 0; iter < max_iter; iter++) {
+                std::fill(neg_f.begin(), neg_f.end(), .0f);
+                std::fill(sum_Q.begin(), sum_Q.end(), .0f);
+                tree->computeQueryForces(&y[0], B, count, theta, &neg_f[0], B, &sum_Q[0]);
+                float mom = iter < max_iter / 4 ? momentum : final_momentum;
+
+                for (int k = 0; k < count; k++) {
+                    const int* nb = neighbours + (size_t) (first + k) * K;
+                    const float* p = P + (size_t) (first + k) * K;
+                    for (int d = 0; d < no_dims; d++) {
+                        pos_f[d * B + k] = .0;
+                    }
+                    for (int j = 0; j < K; j++) {
+                        float dist = .0;
+                        for (int d = 0; d < no_dims; d++) {
+                            float diff = y[d * B + k] - ref_Y[d * ref_stride + nb[j]];
+                            dist += diff * diff;
+                        }
+                        float mult = p[j] / (1.0f + dist);
+                        for (int d = 0; d < no_dims; d++) {
+                            pos_f[d * B + k] += mult * (y[d * B + k] - ref_Y[d * ref_stride + nb[j]]);
+                        }
+                    }
+
+                    // Gradient update with momentum and gains (as updateEmbedding), with the step clipped
+                    float length = .0;
+                    for (int d = 0; d < no_dims; d++) {
+                        int i = d * B + k;
+                        float grad = pos_f[i] - neg_f[i] / sum_Q[k];
+                        bool flip = ((grad > .0f) - (grad < .0f)) != ((uy[i] > .0f) - (uy[i] < .0f));
+                        gains[i] = flip ? (gains[i] + .2f) : (gains[i] * .8f + .01f);
+                        uy[i] = mom * uy[i] - learning_rate * gains[i] * grad;
+                        length += uy[i] * uy[i];
+                    }
+                    float scale = length > max_step * max_step ? max_step / sqrtf(length) : 1.0f;
+                    for (int d = 0; d < no_dims; d++) {
+                        uy[d * B + k] *= scale;
+                        y[d * B + k] += uy[d * B + k];
+                    }
+                }
+            }
+
+            for (int k = 0; k < count; k++) {
+                for (int d = 0; d < no_dims; d++) {
+                    Y[(size_t) (first + k) * no_dims + d] = y[d * B + k];
+                }
+            }
+        }
+    }
+}
+
+
+// Place new points into the reference map: their neighbours among the input points, the calibrated
+// similarities to them, and the positions that fit these in the map
+bool TSNESession::transform(const float* X, int M, float* Y, int num_threads, int max_iter,
+                            float theta, float learning_rate, float max_step, int verbose) const {
+    if (index == NULL || ref_tree == NULL) {
+        if (verbose)
+            fprintf(stderr, "Cannot transform without %s!\n", index == NULL ? "an index (keep_index)" : "a reference map (setReference)");
+        return false;
+    }
+
+#ifdef _OPENMP
+    omp_set_num_threads(NUM_THREADS(num_threads));
+#endif
 
+    // Normalize the new points as the input points were, search their neighbours and calibrate
+    auto start = Clock::now();
+    const int K = (int) (3 * perp);
+    const int padded_D = paddedDims(D);
+    float* queries = allocateAligned((size_t) M * padded_D);
+    int* neighbours = (int*) malloc((size_t) M * K * sizeof(int));
+    float* P = (float*) malloc((size_t) M * K * sizeof(float));
+    if (neighbours == NULL || P == NULL) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+    int not_converged = 0;
+#ifdef _OPENMP
+    #pragma omp parallel reduction(+:not_converged)
+#endif
+    {
+        VpTree::SearchHeap heap;
+        PerplexityCalibrator calibrator(K, perp);
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 16)
+#endif
+        for (int m = 0; m < M; m++) {
+            float* q = queries + (size_t) m * padded_D;
+            for (int d = 0; d < D; d++) {
+                float x = X[(size_t) m * D + d];
+                q[d] = x_mean != NULL ? (x - x_mean[d]) / x_scale : x;
+            }
+            for (int d = D; d < padded_D; d++) {
+                q[d] = .0;
+            }
+            int iterations;
+            index->search(q, K, neighbours + (size_t) m * K, P + (size_t) m * K, heap);
+            if (!calibrator.calibrate(P + (size_t) m * K, P + (size_t) m * K, &iterations)) not_converged++;
+        }
+    }
+    float search_time = duration_cast<dsec>(Clock::now() - start).count();
+
+    start = Clock::now();
+    switch (ref_dims) {
+        case 2:  placePoints<2>(static_cast<const SplitTree<2>*>(ref_tree), ref_Y, ref_stride, ref_dims, neighbours, P, K, M, Y,
+                                max_iter, theta, learning_rate, max_step); break;
+        case 3:  placePoints<3>(static_cast<const SplitTree<3>*>(ref_tree), ref_Y, ref_stride, ref_dims, neighbours, P, K, M, Y,
+                                max_iter, theta, learning_rate, max_step); break;
+        default: placePoints<0>(static_cast<const SplitTree<0>*>(ref_tree), ref_Y, ref_stride, ref_dims, neighbours, P, K, M, Y,
+                                max_iter, theta, learning_rate, max_step); break;
+    }
+    float place_time = duration_cast<dsec>(Clock::now() - start).count();
+    if (verbose) {
+        fprintf(stderr, "Transformed %d points: neighbours and similarities take %.4f (%d points not within tolerance), placement %.4f\n",
+                M, search_time, not_converged, place_time);
+    }
+
+    free(queries);
+    free(neighbours);
+    free(P);
+    return true;
+}
+
+
+/*
+    Step 2: learn a map Y of the points of a session (see TSNE::run for the parameters)
+
+    Internally the map and the optimizer state are kept as no_dims planes (all x, then all y, ...) of
+    plane_stride floats each; Y is only read from and written back to at the start and the end. P is
+    never written to: the early exaggeration is applied to it as it is read.
+*/
+void TSNE::optimize(const TSNESession& session, float* Y, int no_dims, float theta,
+                    int num_threads, int max_iter, int n_iter_early_exag,
+                    int random_state, bool init_from_Y, int verbose,
+                    float early_exaggeration, float learning_rate,
+                    float *final_error, RepulsionMethod inp_repulsion,
+                    const char* checkpoint, int checkpoint_interval, bool resume) {
+
+#ifdef _OPENMP
+    omp_set_num_threads(NUM_THREADS(num_threads));
+#endif
+
+    const int N = session.N;
+    const int64_t* row_P = session.row_P;
+    const int* col_P = session.col_P;
+    const float* val_P = session.val_P;
+
+    // Set learning parameters
+    // set up timer
+    float compute_time = 0.;
+    int stop_lying_iter = n_iter_early_exag, mom_switch_iter = n_iter_early_exag;
+    float momentum = .5, final_momentum = .8;
+    float eta = learning_rate;
+
+    // Allocate some memory: the map and the optimizer state as planes, zero past N in every plane
+    allocateWorkspace(N, no_dims);
+    const int plane_size = no_dims * plane_stride;
+    float* Y_planes = allocateAligned(plane_size);
+    float* uY    = allocateAligned(plane_size);
+    float* gains = allocateAligned(plane_size);
+    float* mean  = (float*) malloc(no_dims * sizeof(float));
+    if (mean == NULL) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+    for (int i = 0; i < plane_size; i++) {
+        Y_planes[i] = .0;
+        uY[i] = .0;
+        gains[i] = 1.0;
+    }
 
     // Lie about the P-values
-    for (int i = 0; i < row_P[N]; i++) {
-        val_P[i] *= early_exaggeration;
+    float exaggeration = early_exaggeration;
+    int first_iter = 0;
+
+    // Resume from the checkpoint: the schedule, where it stands, and the state of the map
+    Checkpoint* saver = checkpoint != NULL ? new Checkpoint(checkpoint) : NULL;
+    if (resume) {
+        Checkpoint::State state;
+        if (saver == NULL || !saver->loadState(N, no_dims, &state, mean, Y_planes, uY, gains, plane_stride) || state.nnz != row_P[N]) {
+            fprintf(stderr, "Could not resume from %s!\n", checkpoint != NULL ? checkpoint : "(no checkpoint)");
+            exit(1);
+        }
+        first_iter = state.iter;
+        stop_lying_iter = state.stop_lying_iter;
+        mom_switch_iter = state.mom_switch_iter;
+        inp_repulsion = (RepulsionMethod) state.repulsion;
+        theta = state.theta;
+        eta = state.learning_rate;
+        exaggeration = state.exaggeration;
+        momentum = state.momentum;
+        final_momentum = state.final_momentum;
+        if (verbose)
+            fprintf(stderr, "Resuming from %s at iteration %d\n", checkpoint, first_iter + 1);
     }
 
-    // Initialize solution (randomly), unless Y is already initialized
-    if (init_from_Y) {
-        stop_lying_iter = 0;  // Immediately stop lying. Passed Y is close to the true solution.
+    repulsion = inp_repulsion;
+    if (repulsion == REPULSION_FFT && no_dims != 2) {
+        if (verbose)
+            fprintf(stderr, "FFT-based repulsion only supports 2D maps, using Barnes-Hut instead.\n");
+        repulsion = REPULSION_BARNES_HUT;
     }
-    else {
-        if (random_state != -1) {
-            srand(random_state);
+    if (verbose) {
+        const char* method = repulsion == REPULSION_FFT ? "FFT interpolation" :
+                             repulsion == REPULSION_DUAL_TREE ? "dual-tree" : "Barnes-Hut";
+        fprintf(stderr, "Using no_dims = %d, perplexity = %f, and theta = %f (%s)\n", no_dims, session.perp, theta, method);
+    }
+    const char* kernel_name;
+    edge_forces = selectEdgeForcesKernel(no_dims, &kernel_name);
+    if (verbose)
+        fprintf(stderr, "Using %s attractive force kernel\nLearning embedding...\n", kernel_name);
+
+    // Initialize solution (randomly), unless Y is already initialized or resumed
+    // (random numbers are drawn in the order of the [N, no_dims] layout, so seeds give the same maps as before)
+    if (init_from_Y && !resume) {
+        stop_lying_iter = 0;  // Immediately stop lying. Passed Y is close to the true solution.
+        for (int n = 0; n < N; n++) {
+            for (int d = 0; d < no_dims; d++) {
+                Y_planes[d * plane_stride + n] = Y[n * no_dims + d];
+            }
         }
-        for (int i = 0; i < N * no_dims; i++) {
-            Y[i] = randn();
+    }
+    else if (!resume) {
+        // (-1 is the unseeded generator, that of srand(1))
+        seedRandom(random_state != -1 ? random_state : 1);
+        for (int n = 0; n < N; n++) {
+            for (int d = 0; d < no_dims; d++) {
+                Y_planes[d * plane_stride + n] = randn();
+            }
         }
     }
 
-    // Perform main training loop
-    compute_time = 0.;
-    compute_start = Clock::now();
+    // P does not change, so it is saved once, while the first iterations run (a resumed run has it saved)
+    if (saver != NULL && !resume) {
+        saver->saveSimilarities(N, row_P, col_P, val_P, session.perp);
+    }
+
+    // Perform main training loop. The map is recentered as part of each update, one iteration late.
+    if (!resume) {
+        computeMean(Y_planes, N, no_dims, mean);
+    }
+    auto compute_start = Clock::now();
     const int eval_interval = 100;
-    for (int iter = 0; iter < max_iter; iter++) {
+    int last_report = first_iter;   // iterations run before the last progress report
+    for (int iter = first_iter; iter < max_iter; iter++) {
         bool need_eval_error = (verbose && ((iter > 0 && iter % eval_interval == 0) || (iter == max_iter - 1)));
 
-        // Compute approximate gradient
-        float error = computeGradient(row_P, col_P, val_P, Y, N, no_dims, dY, theta, need_eval_error);
-
-        for (int i = 0; i < N * no_dims; i++) {
-            // Update gains
-            gains[i] = (sign(dY[i]) != sign(uY[i])) ? (gains[i] + .2) : (gains[i] * .8 + .01);
-
-            // Perform gradient update (with momentum and gains)
-            uY[i] = momentum * uY[i] - eta * gains[i] * dY[i];
-            Y[i] = Y[i] + uY[i];
+        // Compute approximate gradient, with the dimensionality fixed at compile time for 2D and 3D maps
+        float error;
+        switch (no_dims) {
+            case 2:  error = computeGradient<2>(row_P, col_P, val_P, exaggeration, Y_planes, N, no_dims, theta, need_eval_error); break;
+            case 3:  error = computeGradient<3>(row_P, col_P, val_P, exaggeration, Y_planes, N, no_dims, theta, need_eval_error); break;
+            default: error = computeGradient<0>(row_P, col_P, val_P, exaggeration, Y_planes, N, no_dims, theta, need_eval_error); break;
         }
 
-        // Make solution zero-mean
-        zeroMean(Y, N, no_dims);
+        // Perform gradient update (with momentum and gains), subtracting the previous mean
+        updateEmbedding(Y_planes, uY, gains, N, no_dims, momentum, eta, mean);
 
         // Stop lying about the P-values after a while, and switch momentum
         if (iter == stop_lying_iter) {
-            for (int i = 0; i < row_P[N]; i++) {
-                val_P[i] /= early_exaggeration;
-            }
+            exaggeration = 1;
         }
         if (iter == mom_switch_iter) {
             momentum = final_momentum;
         }
 
+        // Save the state the next iteration starts from (the copy is made now, the file written meanwhile),
+        // after the previous write has finished, which is reported if it failed
+        if (saver != NULL && checkpoint_interval > 0 && (iter + 1) % checkpoint_interval == 0) {
+            if (!saver->wait())
+                fprintf(stderr, "Could not write the checkpoint %s\n", saver->path());
+            Checkpoint::State state;
+            state.N = N;
+            state.nnz = row_P[N];
+            state.no_dims = no_dims;
+            state.iter = iter + 1;
+            state.stop_lying_iter = stop_lying_iter;
+            state.mom_switch_iter = mom_switch_iter;
+            state.repulsion = repulsion;
+            state.theta = theta;
+            state.learning_rate = eta;
+            state.exaggeration = exaggeration;
+            state.momentum = momentum;
+            state.final_momentum = final_momentum;
+            saver->saveState(state, mean, Y_planes, uY, gains, plane_stride);
+        }
+
         // Print out progress
         if (need_eval_error) {
             float time_elapsed = duration_cast<dsec>(Clock::now() - compute_start).count();
 
-            if (iter == 0)
-                fprintf(stderr, "Iteration %d: error is %f\n", iter + 1, error);
-            else {
-                fprintf(stderr, "Iteration %d: error is %f (%d iterations in %.4f seconds)\n", iter + 1, error, eval_interval, time_elapsed - compute_time);
-            }
+            fprintf(stderr, "Iteration %d: error is %f (%d iterations in %.4f seconds)\n", iter + 1, error, iter + 1 - last_report, time_elapsed - compute_time);
             compute_time = time_elapsed;
+            last_report = iter + 1;
         }
     }
 
-    if (final_error != NULL)
-        *final_error = evaluateError(row_P, col_P, val_P, Y, N, no_dims, theta);
+    if (saver != NULL) {
+        if (!saver->wait())
+            fprintf(stderr, "Could not write the checkpoint %s\n", saver->path());
+        delete saver;
+    }
+
+    // Make solution zero-mean
+    for (int d = 0; d < no_dims; d++) {
+        for (int n = 0; n < N; n++) {
+            Y_planes[d * plane_stride + n] -= mean[d];
+        }
+    }
+
+    if (final_error != NULL) {
+        switch (no_dims) {
+            case 2:  *final_error = evaluateError<2>(row_P, col_P, val_P, exaggeration, Y_planes, N, no_dims, theta); break;
+            case 3:  *final_error = evaluateError<3>(row_P, col_P, val_P, exaggeration, Y_planes, N, no_dims, theta); break;
+            default: *final_error = evaluateError<0>(row_P, col_P, val_P, exaggeration, Y_planes, N, no_dims, theta); break;
+        }
+    }
+
+    for (int n = 0; n < N; n++) {
+        for (int d = 0; d < no_dims; d++) {
+            Y[n * no_dims + d] = Y_planes[d * plane_stride + n];
+        }
+    }
 
     if (verbose) {
         compute_time = duration_cast<dsec>(Clock::now() - compute_start).count();
@@ -208,104 +666,193 @@ void TSNE::run(float* X, int N, int D, float* Y,
     }
 
     // Clean up memory
-    free(dY);
+    free(Y_planes);
     free(uY);
     free(gains);
+    free(mean);
+    freeWorkspace();
+}
+
+// Allocate the buffers used by computeGradient; the tree itself is built lazily on the first gradient
+// Planes hold N floats rounded up to whole cache lines, which also covers whole Barnes-Hut batches of Q
+void TSNE::allocateWorkspace(int N, int no_dims)
+{
+    freeWorkspace();
+    const int line = 64 / sizeof(float);
+    plane_stride = (N + line - 1) / line * line;
+    Q     = allocateAligned(plane_stride);
+    pos_f = allocateAligned(no_dims * plane_stride);
+    neg_f = allocateAligned(no_dims * plane_stride);
+
+    // A Barnes-Hut batch of forces per thread, each on its own cache lines
+#ifdef _OPENMP
+    int max_threads = omp_get_max_threads();
+#else
+    int max_threads = 1;
+#endif
+    const int B = SplitTree<0>::QT_BATCH_SIZE;
+    batch_stride = (no_dims * B + line - 1) / line * line;
+    batch_f = allocateAligned((size_t) max_threads * batch_stride);
+    block_sums = allocateAligned((N + SUM_BLOCK - 1) / SUM_BLOCK);
+}
 
-    free(row_P); row_P = NULL;
-    free(col_P); col_P = NULL;
-    free(val_P); val_P = NULL;
+void TSNE::freeWorkspace()
+{
+    delete tree; tree = NULL;
+    delete fft; fft = NULL;
+    free(Q); Q = NULL;
+    free(pos_f); pos_f = NULL;
+    free(neg_f); neg_f = NULL;
+    free(batch_f); batch_f = NULL;
+    free(block_sums); block_sums = NULL;
 }
 
-// Compute gradient of the t-SNE cost function (using Barnes-Hut algorithm)
-float TSNE::computeGradient(int* inp_row_P, int* inp_col_P, float* inp_val_P, float* Y, int N, int no_dims, float* dC, float theta, bool eval_error)
+
+// Build the workspace tree on the current map, recycling the nodes of the previous build
+template <int Dims>
+SplitTree<Dims>* TSNE::buildTree(float* Y, int N, int no_dims)
 {
-    // Construct quadtree on current map
-    SplitTree* tree = new SplitTree(Y, N, no_dims);
+    SplitTree<Dims>* typed_tree = dynamic_cast<SplitTree<Dims>*>(tree);
+    if (typed_tree == NULL) {
+        delete tree;
+        typed_tree = new SplitTree<Dims>(Y, plane_stride, N, no_dims);
+        tree = typed_tree;
+    }
+    else {
+        typed_tree->rebuild(Y, plane_stride, N);
+    }
+    return typed_tree;
+}
 
-    // Compute all terms required for t-SNE gradient
-    float* Q = new float[N];
-    float* pos_f = new float[N * no_dims]();
-    float* neg_f = new float[N * no_dims]();
 
+// Compute the terms of the gradient of the t-SNE cost function (using Barnes-Hut algorithm): pos_f, neg_f
+// and sum_Q, which updateEmbedding combines into pos_f - neg_f / sum_Q, for P times exaggeration
+// Dims > 0 fixes the map dimensionality at compile time; Dims == 0 uses inp_no_dims
+template <int Dims>
+float TSNE::computeGradient(const int64_t* inp_row_P, const int* inp_col_P, const float* inp_val_P, float exaggeration,
+                            float* Y, int N, int inp_no_dims, float theta, bool eval_error)
+{
+    const int no_dims = Dims > 0 ? Dims : inp_no_dims;
+
+    // Compute all terms required for t-SNE gradient
     float P_i_sum = 0.;
     float C = 0.;
 
-    if (pos_f == NULL || neg_f == NULL) {
-        fprintf(stderr, "Memory allocation failed!\n"); exit(1);
-    }
-
+    // Edge forces, a block of rows per kernel call
+    const int block = 64;
+    int num_blocks = (N + block - 1) / block;
 #ifdef _OPENMP
     #pragma omp parallel for reduction(+:P_i_sum,C)
 #endif
-    for (int n = 0; n < N; n++) {
-        // Edge forces
-        int ind1 = n * no_dims;
-        for (int i = inp_row_P[n]; i < inp_row_P[n + 1]; i++) {
+    for (int b = 0; b < num_blocks; b++) {
+        edge_forces(inp_row_P, inp_col_P, inp_val_P, exaggeration, Y, no_dims, plane_stride, b * block, std::min(N, (b + 1) * block),
+                    pos_f, eval_error, &P_i_sum, &C);
+    }
 
-            // Compute pairwise distance and Q-value
-            float D = .0;
-            int ind2 = inp_col_P[i] * no_dims;
-            for (int d = 0; d < no_dims; d++) {
-                float t = Y[ind1 + d] - Y[ind2 + d];
-                D += t * t;
-            }
+    // NoneEdge forces
+    sum_Q = computeNonEdgeForces<Dims>(Y, N, no_dims, theta);
 
-            // Sometimes we want to compute error on the go
-            if (eval_error) {
-                P_i_sum += inp_val_P[i];
-                C += inp_val_P[i] * log((inp_val_P[i] + FLT_MIN) / ((1.0 / (1.0 + D)) + FLT_MIN));
-            }
+    C += P_i_sum * log(sum_Q);
 
-            D = inp_val_P[i] / (1.0 + D);
-            // Sum positive force
-            for (int d = 0; d < no_dims; d++) {
-                pos_f[ind1 + d] += D * (Y[ind1 + d] - Y[ind2 + d]);
-            }
-        }
+    return C;
+}
 
-        // NoneEdge forces
-        float this_Q = .0;
 
-        tree->computeNonEdgeForces(n, theta, neg_f + n * no_dims, &this_Q);
-        Q[n] = this_Q;
+// Compute the repulsive forces into neg_f (in point order) and Q (in any order) and return their
+// normalization sum_Q. Barnes-Hut handles points in batches of consecutive points in tree order, which are
+// spatially adjacent, and scatters the forces of each batch back to point order.
+template <int Dims>
+float TSNE::computeNonEdgeForces(float* Y, int N, int no_dims, float theta)
+{
+    if (repulsion == REPULSION_FFT) {
+        if (fft == NULL) {
+            fft = new FFTRepulsion();
+        }
+        fft->computeNonEdgeForces(Y, plane_stride, N, neg_f, Q);
+        return sumQ(N);
     }
 
-    float sum_Q = 0.;
-    for (int i = 0; i < N; i++) {
-        sum_Q += Q[i];
-    }
+    // Construct quadtree on current map
+    SplitTree<Dims>* split_tree = buildTree<Dims>(Y, N, no_dims);
+    const int B = SplitTree<Dims>::QT_BATCH_SIZE;
+    const int* order = split_tree->pointOrder();
 
-    // Compute final t-SNE gradient
-    for (int i = 0; i < N * no_dims; i++) {
-        dC[i] = pos_f[i] - (neg_f[i] / sum_Q);
+    if (repulsion == REPULSION_DUAL_TREE) {
+        split_tree->computeDualTreeForces(theta, neg_f, plane_stride, Q);
     }
+    else {
+        int num_batches = (N + B - 1) / B;
+#ifdef _OPENMP
+        #pragma omp parallel
+#endif
+        {
+#ifdef _OPENMP
+            float* thread_f = batch_f + (size_t) omp_get_thread_num() * batch_stride;
+            #pragma omp for schedule(dynamic, 16)
+#else
+            float* thread_f = batch_f;
+#endif
+            for (int b = 0; b < num_batches; b++) {
+                int first = b * B;
+                int count = std::min(B, N - first);
+                std::fill(thread_f, thread_f + no_dims * B, .0f);
+                for (int i = first; i < first + B; i++) {
+                    Q[i] = .0;
+                }
+                split_tree->computeNonEdgeForces(order + first, count, theta, thread_f, B, Q + first);
+                for (int k = 0; k < count; k++) {
+                    for (int d = 0; d < no_dims; d++) {
+                        neg_f[d * plane_stride + order[first + k]] = thread_f[d * B + k];
+                    }
+                }
+            }
+        }
+    }
+    return sumQ(N);
+}
 
-    delete tree;
-    delete[] pos_f;
-    delete[] neg_f;
-    delete[] Q;
 
-    C += P_i_sum * log(sum_Q);
+float TSNE::sumQ(int N)
+{
+    const int blocks = (N + SUM_BLOCK - 1) / SUM_BLOCK;
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int b = 0; b < blocks; b++) {
+        const int end = std::min(N, (b + 1) * SUM_BLOCK);
+        float sum = .0;
+#ifdef _OPENMP
+        #pragma omp simd reduction(+:sum)
+#endif
+        for (int i = b * SUM_BLOCK; i < end; i++) {
+            sum += Q[i];
+        }
+        block_sums[b] = sum;
+    }
+    return sumBlocks(N);
+}
 
-    return C;
+// Add up the block sums of the last sum over N points
+float TSNE::sumBlocks(int N) const
+{
+    const int blocks = (N + SUM_BLOCK - 1) / SUM_BLOCK;
+    float sum = .0;
+    for (int b = 0; b < blocks; b++) {
+        sum += block_sums[b];
+    }
+    return sum;
 }
 
 
-// Evaluate t-SNE cost function (approximately)
-float TSNE::evaluateError(int* row_P, int* col_P, float* val_P, float* Y, int N, int no_dims, float theta)
+// Evaluate t-SNE cost function (approximately), for P times exaggeration
+template <int Dims>
+float TSNE::evaluateError(const int64_t* row_P, const int* col_P, const float* val_P, float exaggeration,
+                          float* Y, int N, int inp_no_dims, float theta)
 {
+    const int no_dims = Dims > 0 ? Dims : inp_no_dims;
 
     // Get estimate of normalization term
-    SplitTree* tree = new SplitTree(Y, N, no_dims);
-
-    float* buff = new float[no_dims]();
-    float sum_Q = .0;
-    for (int n = 0; n < N; n++) {
-        tree->computeNonEdgeForces(n, theta, buff, &sum_Q);
-    }
-    delete tree;
-    delete[] buff;
+    float sum_Q = computeNonEdgeForces<Dims>(Y, N, no_dims, theta);
 
     // Loop over all edges to compute t-SNE error
     float C = .0;
@@ -313,16 +860,16 @@ float TSNE::evaluateError(int* row_P, int* col_P, float* val_P, float* Y, int N,
     #pragma omp parallel for reduction(+:C)
 #endif
     for (int n = 0; n < N; n++) {
-        int ind1 = n * no_dims;
-        for (int i = row_P[n]; i < row_P[n + 1]; i++) {
+        for (int64_t i = row_P[n]; i < row_P[n + 1]; i++) {
             float Q = .0;
-            int ind2 = col_P[i] * no_dims;
+            int m = col_P[i];
             for (int d = 0; d < no_dims; d++) {
-                float b  = Y[ind1 + d] - Y[ind2 + d];
+                float b  = Y[d * plane_stride + n] - Y[d * plane_stride + m];
                 Q += b * b;
             }
             Q = (1.0 / (1.0 + Q)) / sum_Q;
-            C += val_P[i] * log((val_P[i] + FLT_MIN) / (Q + FLT_MIN));
+            float p = val_P[i] * exaggeration;
+            C += p * log((p + FLT_MIN) / (Q + FLT_MIN));
         }
     }
 
@@ -330,14 +877,15 @@ float TSNE::evaluateError(int* row_P, int* col_P, float* val_P, float* Y, int N,
 }
 
 // Compute input similarities with a fixed perplexity using ball trees (this function allocates memory another function should free)
-void TSNE::computeGaussianPerplexity(float* X, int N, int D, int** _row_P, int** _col_P, float** _val_P, float perplexity, int K, int verbose) {
+void TSNE::computeGaussianPerplexity(const float* X, int N, int D, int64_t** _row_P, int** _col_P, float** _val_P, float perplexity, int K, int verbose,
+                                     VpTree** keep_tree) {
 
     if (perplexity > K) fprintf(stderr, "Perplexity should be lower than K!\n");
 
     // Allocate the memory we need
-    *_row_P = (int*)    malloc((N + 1) * sizeof(int));
-    *_col_P = (int*)    calloc(N * K, sizeof(int));
-    *_val_P = (float*) calloc(N * K, sizeof(float));
+    *_row_P = (int64_t*) malloc((N + 1) * sizeof(int64_t));
+    *_col_P = (int*)    calloc((size_t) N * K, sizeof(int));
+    *_val_P = (float*) calloc((size_t) N * K, sizeof(float));
     if (*_row_P == NULL || *_col_P == NULL || *_val_P == NULL) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
 
     /*
@@ -346,7 +894,7 @@ void TSNE::computeGaussianPerplexity(float* X, int N, int D, int** _row_P, int**
         val_P -- p_{i | j}
     */
 
-    int* row_P = *_row_P;
+    int64_t* row_P = *_row_P;
     int* col_P = *_col_P;
     float* val_P = *_val_P;
 
@@ -355,205 +903,230 @@ void TSNE::computeGaussianPerplexity(float* X, int N, int D, int** _row_P, int**
         row_P[n + 1] = row_P[n] + K;
     }
 
-    // Build ball tree on data set
-    // This part is very fast
-    auto build_tree_start = Clock::now();
-    VpTree<DataPoint, euclidean_distance_squared>* tree = new VpTree<DataPoint, euclidean_distance_squared>();
-    std::vector<DataPoint> obj_X(N, DataPoint(D, -1, X));
-    for (int n = 0; n < N; n++) {
-        obj_X[n] = DataPoint(D, n, X + n * D);
+    // Find the nearest neighbours of every point: their indices go to col_P and their squared distances to
+    // val_P, which the calibration below turns into p_{j | i} in place
+    if (knn == KNN_APPROXIMATE) {
+        auto knn_start = Clock::now();
+        ApproximateKnn* approximate = new ApproximateKnn(X, N, D);
+        approximate->search(K, knn_trees, col_P, val_P, verbose);
+        float knn_time = duration_cast<dsec>(Clock::now() - knn_start).count();
+        if (verbose) {
+            fprintf(stderr, "Approximate nearest neighbours (%d trees) take %.4f\n", knn_trees, knn_time);
+            fprintf(stderr, " - estimated recall %f\n", approximate->recall(val_P, 100));
+        }
+        delete approximate;
     }
-    tree->create(obj_X);
-    float build_tree_time = duration_cast<dsec>(Clock::now() - build_tree_start).count();
-    if (verbose)
-        fprintf(stderr, "Building tree takes %.4f\n", build_tree_time);
+    else if (knn == KNN_BLOCKED) {
+        auto knn_start = Clock::now();
+        if (input != NULL) blockedKnn(*input, K, stream_buffer, col_P, val_P, verbose);
+        else blockedKnn(X, N, D, K, col_P, val_P);
+        float knn_time = duration_cast<dsec>(Clock::now() - knn_start).count();
+        if (verbose)
+            fprintf(stderr, "Blocked brute-force nearest neighbours take %.4f\n", knn_time);
+    }
+    else {
+        // Build ball tree on data set
+        // (in parallel, and the same tree for any number of threads)
+        auto build_tree_start = Clock::now();
+        VpTree* tree = new VpTree();
+        tree->create(X, N, D);
+        float build_tree_time = duration_cast<dsec>(Clock::now() - build_tree_start).count();
+        if (verbose)
+            fprintf(stderr, "Building tree takes %.4f\n", build_tree_time);
 
-    // Loop over all points to find nearest neighbors
-    if (verbose)
-        fprintf(stderr, "Building tree...\n");
+        // Loop over all points to find nearest neighbors, in tree order
+        if (verbose)
+            fprintf(stderr, "Building tree...\n");
 
-    int steps_completed = 0;
-    const int log_freq = 5;
+        // Rows are searched in blocks, each thread with one heap, writing straight into col_P and val_P
+        // (row_P[n] = n * K)
+        const int search_block = 256;
+        int steps_completed = 0;
+        const int log_freq = 5;
 #ifdef _OPENMP
-    #pragma omp parallel for
+        #pragma omp parallel
 #endif
-    for (int n = 0; n < N; n++)
-    {
-        std::vector<float> cur_P(K);
-        std::vector<DataPoint> indices;
-        std::vector<float> distances;
-
-        // Find nearest neighbors
-        tree->search(obj_X[n], K + 1, &indices, &distances);
-
-        // Initialize some variables for binary search
-        bool found = false;
-        float beta = 1.0;
-        float min_beta = -FLT_MAX;
-        float max_beta =  FLT_MAX;
-        float tol = 1e-5;
-
-        // Iterate until we found a good perplexity
-        int iter = 0; float sum_P;
-        while (!found && iter < 200) {
-
-            // Compute Gaussian kernel row
-            for (int m = 0; m < K; m++) {
-                cur_P[m] = exp(-beta * distances[m + 1]);
-            }
+        {
+            VpTree::SearchHeap heap;
+#ifdef _OPENMP
+            #pragma omp for schedule(dynamic, 1)
+#endif
+            for (int first = 0; first < N; first += search_block)
+            {
+                int last = std::min(first + search_block, N);
+                tree->search(first, last, K, col_P, val_P, heap);
 
-            // Compute entropy of current row
-            sum_P = FLT_MIN;
-            for (int m = 0; m < K; m++) {
-                sum_P += cur_P[m];
-            }
-            float H = .0;
-            for (int m = 0; m < K; m++) {
-                H += beta * (distances[m + 1] * cur_P[m]);
-            }
-            H = (H / sum_P) + log(sum_P);
+                // Print progress
+                int steps_before;
+#ifdef _OPENMP
+                #pragma omp atomic capture
+#endif
+                { steps_before = steps_completed; steps_completed += last - first; }
 
-            // Evaluate whether the entropy is within the tolerance level
-            float Hdiff = H - log(perplexity);
-            if (Hdiff < tol && -Hdiff < tol) {
-                found = true;
-            }
-            else {
-                if (Hdiff > 0) {
-                    min_beta = beta;
-                    if (max_beta == FLT_MAX || max_beta == -FLT_MAX)
-                        beta *= 2.0;
-                    else
-                        beta = (beta + max_beta) / 2.0;
-                }
-                else {
-                    max_beta = beta;
-                    if (min_beta == -FLT_MAX || min_beta == FLT_MAX)
-                        beta /= 2.0;
-                    else
-                        beta = (beta + min_beta) / 2.0;
+                int log_step = std::max(N / log_freq, 1);
+                if (verbose && steps_before / log_step != (steps_before + last - first) / log_step)
+                {
+#ifdef _OPENMP
+                    #pragma omp critical
+#endif
+                    fprintf(stderr, " - point %d of %d\n", steps_before + last - first, N);
                 }
             }
-
-            // Update iteration counter
-            iter++;
         }
 
-        // Row-normalize current row of P and store in matrix
-        for (int m = 0; m < K; m++) {
-            cur_P[m] /= sum_P;
-        }
-        for (int m = 0; m < K; m++) {
-            col_P[row_P[n] + m] = indices[m + 1].index();
-            val_P[row_P[n] + m] = cur_P[m];
-        }
+        // Clean up memory, unless the tree is kept
+        if (keep_tree != NULL) *keep_tree = tree;
+        else delete tree;
+    }
 
-        // Print progress
+    // Turn the squared distances of every row into p_{j | i} in place, with one calibrator per thread
+    auto calibration_start = Clock::now();
+    long long total_iterations = 0;
+    int max_iterations = 0;
+    int not_converged = 0;
 #ifdef _OPENMP
-        #pragma omp atomic
+    #pragma omp parallel reduction(+:total_iterations, not_converged) reduction(max:max_iterations)
 #endif
-        ++steps_completed;
-
-        if (verbose && steps_completed % (N / log_freq) == 0)
-        {
+    {
+        PerplexityCalibrator calibrator(K, perplexity);
 #ifdef _OPENMP
-            #pragma omp critical
+        #pragma omp for
 #endif
-            fprintf(stderr, " - point %d of %d\n", steps_completed, N);
+        for (int n = 0; n < N; n++)
+        {
+            int iterations;
+            if (!calibrator.calibrate(val_P + row_P[n], val_P + row_P[n], &iterations)) not_converged++;
+            total_iterations += iterations;
+            max_iterations = std::max(max_iterations, iterations);
         }
     }
-
-    // Clean up memory
-    obj_X.clear();
-    delete tree;
+    float calibration_time = duration_cast<dsec>(Clock::now() - calibration_start).count();
+    if (verbose) {
+        fprintf(stderr, "Perplexity calibration (%s kernel) takes %.4f\n", PerplexityCalibrator::kernelName(), calibration_time);
+        fprintf(stderr, " - %.2f iterations per point on average, %d at most, %d points not within tolerance\n",
+                N > 0 ? (double) total_iterations / N : .0, max_iterations, not_converged);
+    }
 }
 
-void TSNE::symmetrizeMatrix(int** _row_P, int** _col_P, float** _val_P, int N) {
+// Symmetrize P into (P + P^T) / 2, and return the sum of its values
+double TSNE::symmetrizeMatrix(int64_t** _row_P, int** _col_P, float** _val_P, int N) {
 
     // Get sparse matrix
-    int* row_P = *_row_P;
+    int64_t* row_P = *_row_P;
     int* col_P = *_col_P;
     float* val_P = *_val_P;
+    int64_t nnz = row_P[N];
+
+    // Transpose of P by counting sort on the columns: the elements (m, n) of column n as pairs (m, k) of
+    // their row and index in the row (position row_P[m] + k), sorted by row (the order the serial fill
+    // visited them in)
+    int64_t* row_T = (int64_t*) calloc(N + 1, sizeof(int64_t));
+    int64_t* cursor = (int64_t*) malloc(N * sizeof(int64_t));
+    std::pair<int, int>* entries_T = (std::pair<int, int>*) malloc(nnz * sizeof(std::pair<int, int>));
+    if (row_T == NULL || cursor == NULL || (nnz > 0 && entries_T == NULL)) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int64_t i = 0; i < nnz; i++) {
+#ifdef _OPENMP
+        #pragma omp atomic
+#endif
+        row_T[col_P[i] + 1]++;
+    }
+    for (int n = 0; n < N; n++) row_T[n + 1] += row_T[n];
+    memcpy(cursor, row_T, N * sizeof(int64_t));
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 256)
+#endif
+    for (int n = 0; n < N; n++) {
+        for (int64_t i = row_P[n]; i < row_P[n + 1]; i++) {
+            int64_t slot;
+#ifdef _OPENMP
+            #pragma omp atomic capture
+#endif
+            slot = cursor[col_P[i]]++;
+            entries_T[slot] = std::make_pair(n, (int) (i - row_P[n]));
+        }
+    }
 
-    // Count number of elements and row counts of symmetric matrix
-    int* row_counts = (int*) calloc(N, sizeof(int));
-    if (row_counts == NULL) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+    // Sort the columns, and find the mirror of every element (n, col_P[i]): the index of (col_P[i], n) in
+    // row col_P[i] of P, or -1
+    int* mirror = (int*) malloc(nnz * sizeof(int));
+    int* row_counts = (int*) malloc(N * sizeof(int));
+    if ((nnz > 0 && mirror == NULL) || row_counts == NULL) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 256)
+#endif
     for (int n = 0; n < N; n++) {
-        for (int i = row_P[n]; i < row_P[n + 1]; i++) {
-
-            // Check whether element (col_P[i], n) is present
-            bool present = false;
-            for (int m = row_P[col_P[i]]; m < row_P[col_P[i] + 1]; m++) {
-                if (col_P[m] == n) {
-                    present = true;
-                    break;
-                }
-            }
-            if (present) {
-                row_counts[n]++;
-            }
-            else {
-                row_counts[n]++;
-                row_counts[col_P[i]]++;
-            }
+        std::pair<int, int>* first = entries_T + row_T[n];
+        std::pair<int, int>* last = entries_T + row_T[n + 1];
+        std::sort(first, last);
+        for (int64_t i = row_P[n]; i < row_P[n + 1]; i++) {
+            std::pair<int, int>* t = std::lower_bound(first, last, std::make_pair(col_P[i], 0));
+            mirror[i] = t != last && t->first == col_P[i] ? t->second : -1;
         }
     }
-    int no_elem = 0;
+
+    // Row n of the result is, in order: the elements (m, n) of P with m < n, the elements (n, m) of P
+    // but those with m < n present in both (already added as the former), and the elements (m, n) of P
+    // with m > n that are not present as (n, m)
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 256)
+#endif
     for (int n = 0; n < N; n++) {
-        no_elem += row_counts[n];
+        int count = 0;
+        for (int64_t t = row_T[n]; t < row_T[n + 1]; t++) {
+            if (entries_T[t].first < n || mirror[row_P[entries_T[t].first] + entries_T[t].second] < 0) count++;
+        }
+        for (int64_t i = row_P[n]; i < row_P[n + 1]; i++) {
+            if (mirror[i] < 0 || n <= col_P[i]) count++;
+        }
+        row_counts[n] = count;
     }
-    // Allocate memory for symmetrized matrix
-    int*    sym_row_P = (int*)    malloc((N + 1) * sizeof(int));
-    int*    sym_col_P = (int*)    malloc(no_elem * sizeof(int));
-    float* sym_val_P = (float*) malloc(no_elem * sizeof(float));
-    if (sym_row_P == NULL || sym_col_P == NULL || sym_val_P == NULL) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
 
-    // Construct new row indices for symmetric matrix
+    // Allocate memory for symmetrized matrix
+    int64_t* sym_row_P = (int64_t*) malloc((N + 1) * sizeof(int64_t));
+    if (sym_row_P == NULL) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
     sym_row_P[0] = 0;
     for (int n = 0; n < N; n++) sym_row_P[n + 1] = sym_row_P[n] + row_counts[n];
+    int64_t no_elem = sym_row_P[N];
+    int*    sym_col_P = (int*)    malloc(no_elem * sizeof(int));
+    float* sym_val_P = (float*) malloc(no_elem * sizeof(float));
+    double* row_sums = (double*) malloc(N * sizeof(double));
+    if (sym_col_P == NULL || sym_val_P == NULL || row_sums == NULL) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
 
-    // Fill the result matrix
-    int* offset = (int*) calloc(N, sizeof(int));
-    if (offset == NULL) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+    // Fill the result matrix, halving the values, and sum them by row
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 256)
+#endif
     for (int n = 0; n < N; n++) {
-        for (int i = row_P[n]; i < row_P[n + 1]; i++) {                                 // considering element(n, col_P[i])
-
-            // Check whether element (col_P[i], n) is present
-            bool present = false;
-            for (int m = row_P[col_P[i]]; m < row_P[col_P[i] + 1]; m++) {
-                if (col_P[m] == n) {
-                    present = true;
-                    if (n <= col_P[i]) {                                                // make sure we do not add elements twice
-                        sym_col_P[sym_row_P[n]        + offset[n]]        = col_P[i];
-                        sym_col_P[sym_row_P[col_P[i]] + offset[col_P[i]]] = n;
-                        sym_val_P[sym_row_P[n]        + offset[n]]        = val_P[i] + val_P[m];
-                        sym_val_P[sym_row_P[col_P[i]] + offset[col_P[i]]] = val_P[i] + val_P[m];
-                    }
-                }
-            }
-
-            // If (col_P[i], n) is not present, there is no addition involved
-            if (!present) {
-                sym_col_P[sym_row_P[n]        + offset[n]]        = col_P[i];
-                sym_col_P[sym_row_P[col_P[i]] + offset[col_P[i]]] = n;
-                sym_val_P[sym_row_P[n]        + offset[n]]        = val_P[i];
-                sym_val_P[sym_row_P[col_P[i]] + offset[col_P[i]]] = val_P[i];
-            }
-
-            // Update offsets
-            if (!present || (n <= col_P[i])) {
-                offset[n]++;
-                if (col_P[i] != n) {
-                    offset[col_P[i]]++;
-                }
-            }
+        int64_t k = sym_row_P[n];
+        double row_sum = .0;
+        for (int64_t t = row_T[n]; t < row_T[n + 1] && entries_T[t].first < n; t++) {
+            int64_t i = row_P[entries_T[t].first] + entries_T[t].second;
+            sym_col_P[k] = entries_T[t].first;
+            sym_val_P[k] = (mirror[i] < 0 ? val_P[i] : val_P[i] + val_P[row_P[n] + mirror[i]]) / 2.0f;
+            row_sum += sym_val_P[k++];
+        }
+        for (int64_t i = row_P[n]; i < row_P[n + 1]; i++) {
+            if (mirror[i] >= 0 && col_P[i] < n) continue;
+            sym_col_P[k] = col_P[i];
+            sym_val_P[k] = (mirror[i] < 0 ? val_P[i] : val_P[i] + val_P[row_P[col_P[i]] + mirror[i]]) / 2.0f;
+            row_sum += sym_val_P[k++];
+        }
+        for (int64_t t = row_T[n]; t < row_T[n + 1]; t++) {
+            int64_t i = row_P[entries_T[t].first] + entries_T[t].second;
+            if (entries_T[t].first <= n || mirror[i] >= 0) continue;
+            sym_col_P[k] = entries_T[t].first;
+            sym_val_P[k] = val_P[i] / 2.0f;
+            row_sum += sym_val_P[k++];
         }
+        row_sums[n] = row_sum;
     }
 
-    // Divide the result by two
-    for (int i = 0; i < no_elem; i++) {
-        sym_val_P[i] /= 2.0;
-    }
+    // (in order of the rows, so that the sum does not depend on the number of threads)
+    double sum_P = .0;
+    for (int n = 0; n < N; n++) sum_P += row_sums[n];
 
     // Return symmetrized matrices
     free(*_row_P); *_row_P = sym_row_P;
@@ -561,20 +1134,22 @@ void TSNE::symmetrizeMatrix(int** _row_P, int** _col_P, float** _val_P, int N) {
     free(*_val_P); *_val_P = sym_val_P;
 
     // Free up some memery
-    free(offset); offset = NULL;
-    free(row_counts); row_counts  = NULL;
+    free(row_T); free(cursor); free(entries_T); free(mirror);
+    free(row_counts); free(row_sums);
+    return sum_P;
 }
 
 
-// Makes data zero-mean
-void TSNE::zeroMean(float* X, int N, int D) {
+// Makes data zero-mean, and writes the mean that was subtracted to mean
+void TSNE::zeroMean(float* X, int N, int D, float* mean) {
 
     // Compute data mean
-    float* mean = (float*) calloc(D, sizeof(float));
-    if (mean == NULL) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+    for (int d = 0; d < D; d++) {
+        mean[d] = .0;
+    }
     for (int n = 0; n < N; n++) {
         for (int d = 0; d < D; d++) {
-            mean[d] += X[n * D + d];
+            mean[d] += X[(size_t) n * D + d];
         }
     }
     for (int d = 0; d < D; d++) {
@@ -584,19 +1159,100 @@ void TSNE::zeroMean(float* X, int N, int D) {
     // Subtract data mean
     for (int n = 0; n < N; n++) {
         for (int d = 0; d < D; d++) {
-            X[n * D + d] -= mean[d];
+            X[(size_t) n * D + d] -= mean[d];
+        }
+    }
+}
+
+
+// Mean of a map stored as planes
+void TSNE::computeMean(const float* Y, int N, int no_dims, float* mean) {
+    for (int d = 0; d < no_dims; d++) {
+        const float* Y_d = Y + d * plane_stride;
+        const int blocks = (N + SUM_BLOCK - 1) / SUM_BLOCK;
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (int b = 0; b < blocks; b++) {
+            const int end = std::min(N, (b + 1) * SUM_BLOCK);
+            float sum = .0;
+#ifdef _OPENMP
+            #pragma omp simd reduction(+:sum)
+#endif
+            for (int n = b * SUM_BLOCK; n < end; n++) {
+                sum += Y_d[n];
+            }
+            block_sums[b] = sum;
         }
+        mean[d] = sumBlocks(N) / N;
     }
-    free(mean); mean = NULL;
 }
 
 
+// One gradient descent step with momentum and gains, in a single pass per plane that also forms the
+// gradient pos_f - neg_f / sum_Q and recenters the map. On entry mean holds the mean of Y, which is
+// subtracted; on return it holds the mean of the updated Y, to be subtracted by the next step (the
+// gradient does not depend on where the map is centered).
+void TSNE::updateEmbedding(float* Y, float* uY, float* gains, int N, int no_dims, float momentum, float eta, float* mean) {
+    const float inv_sum_Q = 1.0f / sum_Q;
+    for (int d = 0; d < no_dims; d++) {
+        float* Y_d = Y + d * plane_stride;
+        float* uY_d = uY + d * plane_stride;
+        float* gains_d = gains + d * plane_stride;
+        const float* pos_f_d = pos_f + d * plane_stride;
+        const float* neg_f_d = neg_f + d * plane_stride;
+        const float shift = mean[d];
+        const int blocks = (N + SUM_BLOCK - 1) / SUM_BLOCK;
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (int b = 0; b < blocks; b++) {
+            const int end = std::min(N, (b + 1) * SUM_BLOCK);
+            float sum = .0;
+#ifdef _OPENMP
+            #pragma omp simd reduction(+:sum)
+#endif
+            for (int n = b * SUM_BLOCK; n < end; n++) {
+                float grad = pos_f_d[n] - neg_f_d[n] * inv_sum_Q;
+
+                // Update gains (comparing signs as sign() does, but without branches)
+                bool flip = ((grad > .0f) - (grad < .0f)) != ((uY_d[n] > .0f) - (uY_d[n] < .0f));
+                float gain = flip ? (gains_d[n] + .2f) : (gains_d[n] * .8f + .01f);
+                gains_d[n] = gain;
+
+                // Perform gradient update (with momentum and gains)
+                float u = momentum * uY_d[n] - eta * gain * grad;
+                uY_d[n] = u;
+                float y = Y_d[n] - shift + u;
+                Y_d[n] = y;
+                sum += y;
+            }
+            block_sums[b] = sum;
+        }
+        mean[d] = sumBlocks(N) / N;
+    }
+}
+
+
+// Seeds the generator of randn, as srand seeds rand
+void TSNE::seedRandom(unsigned int seed) {
+    memset(&rng, 0, sizeof(rng));
+    initstate_r(seed, rng_state, sizeof(rng_state), &rng);
+}
+
+// Uniform random number in [0, 1) from the generator of the object
+static float uniform(struct random_data* rng) {
+    int32_t r;
+    random_r(rng, &r);
+    return r / ((float) RAND_MAX + 1);
+}
+
 // Generates a Gaussian random number
 float TSNE::randn() {
     float x, radius;
     do {
-        x = 2 * (rand() / ((float) RAND_MAX + 1)) - 1;
-        float y = 2 * (rand() / ((float) RAND_MAX + 1)) - 1;
+        x = 2 * uniform(&rng) - 1;
+        float y = 2 * uniform(&rng) - 1;
         radius = (x * x) + (y * y);
     } while ((radius >= 1.0) || (radius == 0.0));
     radius = sqrt(-2 * log(radius) / radius);
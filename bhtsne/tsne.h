@@ -11,24 +11,203 @@
 #ifndef TSNE_H
 #define TSNE_H
 
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "edgeforces.h"
+
 static inline float sign(float x) { return (x == .0 ? .0 : (x < .0 ? -1.0 : 1.0)); }
 
+class SplitTreeBase;
+template <int Dims> class SplitTree;
+class FFTRepulsion;
+class InputFile;
+class SimilarityCache;
+class VpTree;
+class Checkpoint;
+class TSNESession;
+
+// Approximation used for the repulsive (non-edge) forces; the tree methods use theta as the accuracy trade-off
+enum RepulsionMethod {
+    REPULSION_BARNES_HUT = 0,   // point-cell Barnes-Hut
+    REPULSION_DUAL_TREE = 1,    // cell-cell interactions, pushed down to the points
+    REPULSION_FFT = 2           // interpolation on a grid and FFT convolution (2D maps only, ignores theta)
+};
+
+// Search for the nearest neighbours of the input points, from which the input similarities are computed
+enum KnnMethod {
+    KNN_VPTREE = 0,             // exact, vantage-point tree
+    KNN_APPROXIMATE = 1,        // random projection forest refined by NN-descent (see ApproximateKnn)
+    KNN_BLOCKED = 2,            // exact, blocked brute force (see blockedKnn)
+    KNN_AUTO = 3                // KNN_BLOCKED or KNN_VPTREE, by the size of the input (see preferBlockedKnn)
+};
+
+// One optimization of a map on the input similarities of a TSNESession, with the parameters of TSNE::run
+struct TSNEOptimization
+{
+    float* Y;                   // [N, no_dims], the result (and the initial map with init_from_Y)
+    int no_dims;
+    float theta;
+    int max_iter;
+    int n_iter_early_exag;
+    int random_state;
+    bool init_from_Y;
+    int verbose;
+    float early_exaggeration;
+    float learning_rate;
+    RepulsionMethod repulsion;
+    const char* checkpoint;
+    int checkpoint_interval;
+    bool resume;
+    float final_error;          // set after the run
+
+    TSNEOptimization(float* Y = NULL, int no_dims = 2) : Y(Y), no_dims(no_dims), theta(.5), max_iter(1000),
+        n_iter_early_exag(250), random_state(0), init_from_Y(false), verbose(0), early_exaggeration(12),
+        learning_rate(200), repulsion(REPULSION_BARNES_HUT), checkpoint(NULL), checkpoint_interval(0),
+        resume(false), final_error(0) {}
+};
+
 class TSNE
 {
+    friend class TSNESession;
 public:
+    TSNE();
+    ~TSNE();
     void run(float* X, int N, int D, float* Y,
                int no_dims = 2, float perplexity = 30, float theta = .5,
                int num_threads = 1, int max_iter = 1000, int n_iter_early_exag = 250,
                int random_state = 0, bool init_from_Y = false, int verbose = 0,
                float early_exaggeration = 12, float learning_rate = 200,
-               float *final_error = NULL);
-    void symmetrizeMatrix(int** row_P, int** col_P, float** val_P, int N);
+               float *final_error = NULL, RepulsionMethod repulsion = REPULSION_BARNES_HUT,
+               KnnMethod knn = KNN_AUTO, int knn_trees = 8, const char* cache_dir = NULL,
+               bool read_only_X = false, InputFile* input = NULL, size_t stream_buffer = 1 << 30,
+               const char* checkpoint = NULL, int checkpoint_interval = 0);
+    void optimize(const TSNESession& session, float* Y, int no_dims = 2, float theta = .5,
+                  int num_threads = 1, int max_iter = 1000, int n_iter_early_exag = 250,
+                  int random_state = 0, bool init_from_Y = false, int verbose = 0,
+                  float early_exaggeration = 12, float learning_rate = 200,
+                  float *final_error = NULL, RepulsionMethod repulsion = REPULSION_BARNES_HUT,
+                  const char* checkpoint = NULL, int checkpoint_interval = 0, bool resume = false);
+    double symmetrizeMatrix(int64_t** row_P, int** col_P, float** val_P, int N);
 private:
-    float computeGradient(int* inp_row_P, int* inp_col_P, float* inp_val_P, float* Y, int N, int D, float* dC, float theta, bool eval_error);
-    float evaluateError(int* row_P, int* col_P, float* val_P, float* Y, int N, int no_dims, float theta);
-    void zeroMean(float* X, int N, int D);
-    void computeGaussianPerplexity(float* X, int N, int D, int** _row_P, int** _col_P, float** _val_P, float perplexity, int K, int verbose);
+    template <int Dims>
+    float computeGradient(const int64_t* inp_row_P, const int* inp_col_P, const float* inp_val_P, float exaggeration,
+                          float* Y, int N, int D, float theta, bool eval_error);
+    template <int Dims>
+    float evaluateError(const int64_t* row_P, const int* col_P, const float* val_P, float exaggeration,
+                        float* Y, int N, int no_dims, float theta);
+    template <int Dims>
+    SplitTree<Dims>* buildTree(float* Y, int N, int no_dims);
+    template <int Dims>
+    float computeNonEdgeForces(float* Y, int N, int no_dims, float theta);
+    float sumQ(int N);
+    void zeroMean(float* X, int N, int D, float* mean);
+    void computeMean(const float* Y, int N, int no_dims, float* mean);
+    void updateEmbedding(float* Y, float* uY, float* gains, int N, int no_dims, float momentum, float eta, float* mean);
+    void computeGaussianPerplexity(const float* X, int N, int D, int64_t** _row_P, int** _col_P, float** _val_P, float perplexity, int K, int verbose,
+                                   VpTree** keep_tree = NULL);
+    void seedRandom(unsigned int seed);
     float randn();
+
+    // Gradient workspace, sized once per run and reused by every iteration
+    void allocateWorkspace(int N, int no_dims);
+    void freeWorkspace();
+    RepulsionMethod repulsion;
+    KnnMethod knn;
+    int knn_trees;
+    InputFile* input;           // X streamed from a file, or NULL
+    size_t stream_buffer;
+    EdgeForcesKernel edge_forces;
+    SplitTreeBase* tree;
+    FFTRepulsion* fft;
+    int plane_stride;       // floats per plane of the map, the optimizer state, pos_f and neg_f
+    float* Q;
+    float* pos_f;
+    float* neg_f;
+    float* batch_f;         // per thread, batch_stride floats apart
+    int batch_stride;
+    // Sums over the points are taken by blocks of SUM_BLOCK points in parallel, then over the blocks in
+    // order, so that they do not depend on how the blocks were shared between the threads
+    static const int SUM_BLOCK = 4096;
+    float* block_sums;      // per block
+    float sumBlocks(int N) const;
+    float sum_Q;
+
+    // Generator of the initial map, with the state of rand() but private to the object
+    struct random_data rng;
+    char rng_state[128];
+};
+
+
+/*
+    The input similarities P of a data set, computed once (step 1 of TSNE::run) for any number of
+    optimizations of maps on them, with TSNE::optimize or optimize below. P is only read by the
+    optimizations, which may then run at the same time, each with its own TSNE object.
+
+    With keep_index, the session also keeps a VpTree over the (normalized) input points, the one of the
+    neighbour search if it used one, and can then place new points into a map of its points without
+    refitting: setReference freezes the map, and transform places every new point independently, by the
+    calibrated similarities to its neighbours among the input points, against the fixed map.
+*/
+class TSNESession
+{
+    friend class TSNE;
+public:
+    // The parameters are those of TSNE::run (perplexity is adjusted down for small N)
+    TSNESession(float* X, int N, int D, float perplexity = 30, int num_threads = 1, int verbose = 0,
+                KnnMethod knn = KNN_AUTO, int knn_trees = 8, const char* cache_dir = NULL,
+                bool read_only_X = false, InputFile* input = NULL, size_t stream_buffer = 1 << 30,
+                bool keep_index = false);
+    ~TSNESession();
+
+    // The session of the P saved with a checkpoint (see Checkpoint), to resume its optimization; NULL if
+    // it cannot be read
+    static TSNESession* fromCheckpoint(const char* checkpoint, int verbose = 0);
+
+    int rows() const { return N; }
+    float perplexity() const { return perp; }
+
+    // Run count optimizations, as many at a time as num_threads allows (with the threads shared between
+    // them), and set their final_error
+    void optimize(TSNEOptimization* runs, int count, int num_threads = 1) const;
+
+    // Freeze a map Y [N, no_dims] of the points (copied) as the reference of transform
+    void setReference(const float* Y, int no_dims);
+
+    /*
+        Place M new points X [M, D] (in the units of the input, normalized as it was) into the reference
+        map, writing them to Y [M, no_dims]. Every point starts at the median of its neighbours in the map
+        and takes max_iter steps of gradient descent with momentum and gains, each step clipped to a length
+        of max_step; the repulsion of the map uses the Barnes-Hut approximation with theta. Returns false,
+        and does nothing, without an index or a reference.
+    */
+    bool transform(const float* X, int M, float* Y, int num_threads = 1, int max_iter = 50,
+                   float theta = .5, float learning_rate = 1, float max_step = 1, int verbose = 0) const;
+
+private:
+    int N;
+    int D;
+    float perp;
+    int64_t* row_P;
+    int* col_P;
+    float* val_P;
+    SimilarityCache* cache;
+    Checkpoint* source;         // the checkpoint P was loaded from, or NULL
+    bool mapped;                // P is mapped by the cache or the checkpoint
+
+    // transform: the normalization of the input points (mean NULL if they were not normalized), the
+    // index over them and the reference map, as planes, with the tree over it
+    float* x_mean;
+    float x_scale;
+    VpTree* index;
+    int ref_dims;
+    int ref_stride;
+    float* ref_Y;
+    SplitTreeBase* ref_tree;
+
+    TSNESession();
+    TSNESession(const TSNESession&);
+    TSNESession& operator= (const TSNESession&);
 };
 
 #endif
@@ -6,8 +6,18 @@
 #include <ctime>
 #include <cassert>
 #include <chrono>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "tsne.h"
+#include "inputfile.h"
 
 using namespace std::chrono;
 typedef std::chrono::high_resolution_clock Clock;
@@ -76,15 +86,77 @@ bool loadData(const char* fileName, float** data, int* dataN, int* dataDim) {
   fread(dataN, sizeof(int), 1, file); 
   // original dimensionality
   fread(dataDim, sizeof(int), 1, file);
-  *data = (float*) malloc(*dataDim * *dataN * sizeof(float));
+  *data = (float*) malloc((size_t) *dataN * *dataDim * sizeof(float));
   if(*data == NULL) { printf("Memory allocation failed!\n"); exit(1); }
   // read the data
-  fread(*data, sizeof(float), *dataN * *dataDim, file);
+  fread(*data, sizeof(float), (size_t) *dataN * *dataDim, file);
   fclose(file);
   printf("Read %i x %i data matrix successfully!\n", *dataN, *dataDim);
   return true;
 }
 
+// Function that maps the data of our custom binary file instead of reading it: privately (writes stay in
+// memory, and are not written back) or read-only. The pages are touched first by all threads, in turns of
+// TOUCH_CHUNK bytes, so that on NUMA machines they are spread over the nodes instead of all placed on the
+// node of one reading thread (with a single thread, MAP_POPULATE faults them in). Each thread advises its
+// chunk as needed before touching it, so that the chunk is read ahead, onto the node of that thread.
+// Note: the mapping (*mapping, *mappingSize) should be unmapped elsewhere
+static const size_t TOUCH_CHUNK = 4 << 20;
+
+bool mapData(const char* fileName, float** data, int* dataN, int* dataDim, bool writable, int numThreads,
+             void** mapping, size_t* mappingSize) {
+  int fd = open(fileName, O_RDONLY);
+  if (fd < 0) {
+    printf("Error: could not open data file: %s.\n", fileName);
+    return false;
+  }
+  struct stat st;
+  int header[2];
+  if (fstat(fd, &st) != 0 || pread(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+      (size_t) st.st_size < sizeof(header) + (size_t) header[0] * header[1] * sizeof(float)) {
+    printf("Error: could not read data file: %s.\n", fileName);
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  int flags = MAP_PRIVATE | (numThreads > 1 ? 0 : MAP_POPULATE);
+  void* ptr = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, flags, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    printf("Error: could not map data file: %s.\n", fileName);
+    return false;
+  }
+
+  if (numThreads > 1) {
+    // (a write to a private page makes its copy, so writable pages are written to, with the same value)
+    long page = sysconf(_SC_PAGESIZE);
+    long chunks = (long) ((size + TOUCH_CHUNK - 1) / TOUCH_CHUNK);
+    volatile char* bytes = (volatile char*) ptr;
+    unsigned long checksum = 0;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static, 1) num_threads(numThreads) reduction(+:checksum)
+#endif
+    for (long c = 0; c < chunks; c++) {
+      size_t end = std::min(size, (c + 1) * TOUCH_CHUNK);
+      madvise((char*) ptr + c * TOUCH_CHUNK, end - c * TOUCH_CHUNK, MADV_WILLNEED);
+      for (size_t b = c * TOUCH_CHUNK; b < end; b += page) {
+        char value = bytes[b];
+        if (writable) bytes[b] = value;
+        checksum += value;
+      }
+    }
+    (void) checksum;
+  }
+
+  *dataN = header[0];
+  *dataDim = header[1];
+  *data = (float*) ((char*) ptr + sizeof(header));
+  *mapping = ptr;
+  *mappingSize = size;
+  printf("Mapped %i x %i data matrix successfully!\n", *dataN, *dataDim);
+  return true;
+}
+
 // Function that saves map to our custom binary file
 void saveData(const char* fileName, float* data, int dataN, int dataDim, int numThreads) {
   int fileNameLen = strlen(fileName);
@@ -99,7 +171,7 @@ void saveData(const char* fileName, float* data, int dataN, int dataDim, int num
   }
   fwrite(&dataN, sizeof(int), 1, file);
   fwrite(&dataDim, sizeof(int), 1, file);
-  fwrite(data, sizeof(float), dataN * dataDim, file);
+  fwrite(data, sizeof(float), (size_t) dataN * dataDim, file);
   fclose(file);
   free(outFilePath);
   printf("Wrote %i x %i data matrix successfully!\n", dataN, dataDim);
@@ -120,27 +192,143 @@ int main(int argc, const char *argv[]) {
   const int maxIter = getOptionInt("-i", 1000);
   const float perplexity = getOptionFloat("-p", 50.f);
   const float theta = getOptionFloat("-t", 0.5f);
+  // repulsion: 0 = Barnes-Hut, 1 = dual-tree, 2 = FFT interpolation (2D only)
+  const int repulsion = getOptionInt("-m", 0);
+  // nearest neighbours: 0 = exact (VP tree), 1 = approximate with -a random projection trees,
+  // 2 = exact (blocked brute force), 3 = 0 or 2 by the size of the data
+  const int knn = getOptionInt("-k", 3);
+  const int knnTrees = getOptionInt("-a", 8);
+  // directory to cache the input similarities in, for reruns on the same data (none by default)
+  const char *cacheDir = getOptionString("-c", nullptr);
+  // input: 0 = read into memory, 1 = mapped privately (normalized in place), 2 = mapped read-only
+  // (not normalized, see TSNE::run), 3 = streamed from disk with -b MB of rows in memory at a time
+  const int inputMode = getOptionInt("-l", 0);
+  const int streamBufferMB = getOptionInt("-b", 1024);
+  // maps to learn on the same input similarities, with the seeds -r, -r + 1, ..., several at a time if
+  // -n allows (the outputs of the seeds after -r are suffixed with the seed)
+  const int numSeeds = getOptionInt("-s", 1);
+  // new points to place into the map (of the seed -r) after it is learned, without refitting; saved with
+  // the suffix _transform (not with -l 3, which keeps no index of the input)
+  const char *transformFile = getOptionString("-x", nullptr);
+  // checkpoint file to write every -e iterations (with the input similarities in the file + ".P"), for
+  // single maps; with -u 1, resume from it instead of starting (the input file then only names the output)
+  const char *checkpoint = getOptionString("-w", nullptr);
+  const int checkpointInterval = getOptionInt("-e", 100);
+  const int resume = getOptionInt("-u", 0);
 
   assert(inputFile != nullptr && "Please specify input file");
+  if (checkpoint != nullptr && numSeeds > 1) {
+    printf("Error: checkpoints (-w) are written for single maps, not for several seeds (-s).\n");
+    exit(1);
+  }
+  if (transformFile != nullptr && inputMode == 3) {
+    printf("Error: points cannot be transformed (-x) when the input is streamed (-l 3).\n");
+    exit(1);
+  }
 
   // Define some variables
   int dataN, dataDim;
   float *data;
 
   // load dataset
-  bool dataLoaded = loadData(inputFile, &data, &dataN, &dataDim);
+  void* mapping = NULL;
+  size_t mappingSize = 0;
+  int loadThreads = 1;
+#ifdef _OPENMP
+  loadThreads = numThreads >= 0 ? numThreads : omp_get_num_procs() + numThreads + 1;
+#endif
+  InputFile* stream = NULL;
+  TSNESession* resumed = NULL;
+  bool dataLoaded;
+  if (resume) {
+    assert(checkpoint != nullptr && "Please specify the checkpoint to resume from");
+    resumed = TSNESession::fromCheckpoint(checkpoint, verbose);
+    dataLoaded = resumed != NULL;
+    if (!dataLoaded) printf("Error: could not read checkpoint: %s.\n", checkpoint);
+    dataN = dataLoaded ? resumed->rows() : 0;
+    dataDim = 0;
+    data = NULL;
+  }
+  else if (inputMode == 3) {
+    stream = new InputFile();
+    dataLoaded = stream->open(inputFile);
+    if (!dataLoaded) printf("Error: could not open data file: %s.\n", inputFile);
+    dataN = stream->rows();
+    dataDim = stream->dims();
+    data = NULL;
+  }
+  else {
+    dataLoaded = inputMode == 0 ? loadData(inputFile, &data, &dataN, &dataDim) :
+                 mapData(inputFile, &data, &dataN, &dataDim, inputMode == 1, loadThreads, &mapping, &mappingSize);
+  }
 
   assert(dataLoaded);
 
   // set up
-  float* dimReducedData = (float*) malloc(dataN * reducedDim * sizeof(float));
+  const size_t mapSize = (size_t) dataN * reducedDim;
+  float* dimReducedData = (float*) malloc(mapSize * std::max(numSeeds, 1) * sizeof(float));
+  if (dimReducedData == NULL) { printf("Memory allocation failed!\n"); exit(1); }
   auto compute_start = Clock::now();
   float compute_time = 0;
-  TSNE TSNERunner;
 
   // Now fire up the SNE implementation
-  TSNERunner.run(data, dataN, dataDim, dimReducedData,
-            reducedDim, perplexity, theta, numThreads, maxIter, 250, randSeed, false, verbose);
+  if (resume) {
+    TSNE TSNERunner;
+    TSNERunner.optimize(*resumed, dimReducedData, reducedDim, theta, numThreads, maxIter, 250, randSeed, false,
+              verbose, 12, 200, NULL, (RepulsionMethod) repulsion, checkpoint, checkpointInterval, true);
+  }
+  else if (numSeeds <= 1 && transformFile == nullptr) {
+    TSNE TSNERunner;
+    TSNERunner.run(data, dataN, dataDim, dimReducedData,
+              reducedDim, perplexity, theta, numThreads, maxIter, 250, randSeed, false, verbose,
+              12, 200, NULL, (RepulsionMethod) repulsion, (KnnMethod) knn, knnTrees, cacheDir, inputMode == 2,
+              stream, (size_t) streamBufferMB << 20, checkpoint, checkpointInterval);
+  }
+  else {
+    TSNESession session(data, dataN, dataDim, perplexity, numThreads, verbose, (KnnMethod) knn, knnTrees,
+                        cacheDir, inputMode == 2, stream, (size_t) streamBufferMB << 20, transformFile != nullptr);
+    TSNEOptimization* runs = new TSNEOptimization[numSeeds];
+    for (int s = 0; s < numSeeds; s++) {
+      runs[s] = TSNEOptimization(dimReducedData + s * mapSize, reducedDim);
+      runs[s].theta = theta;
+      runs[s].max_iter = maxIter;
+      runs[s].random_state = randSeed + s;
+      runs[s].verbose = verbose;
+      runs[s].repulsion = (RepulsionMethod) repulsion;
+      runs[s].checkpoint = checkpoint;
+      runs[s].checkpoint_interval = checkpointInterval;
+    }
+    session.optimize(runs, numSeeds, numThreads);
+    for (int s = 0; s < numSeeds; s++)
+      printf("Seed %d: error is %f\n", randSeed + s, runs[s].final_error);
+    delete[] runs;
+
+    if (transformFile != nullptr) {
+      int newN, newDim;
+      float* newData;
+      if (!loadData(transformFile, &newData, &newN, &newDim) || newDim != dataDim) {
+        printf("Error: the points to transform should have %d dimensions.\n", dataDim);
+        exit(1);
+      }
+      float* newMap = (float*) malloc((size_t) newN * reducedDim * sizeof(float));
+      if (newMap == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+      auto transform_start = Clock::now();
+      session.setReference(dimReducedData, reducedDim);
+      if (!session.transform(newData, newN, newMap, numThreads, 50, theta, 1, 1, verbose)) {
+        printf("Error: could not transform the points of %s.\n", transformFile);
+        exit(1);
+      }
+      printf("Transform Time: %.4f seconds.\n", duration_cast<dsec>(Clock::now() - transform_start).count());
+      char* newFileName = getOutputFileName(transformFile);
+      char* transformFileName = (char*) malloc(strlen(newFileName) + 16);
+      sprintf(transformFileName, "%s_transform", newFileName);
+      saveData(transformFileName, newMap, newN, reducedDim, numThreads);
+      free(transformFileName);
+      free(newFileName);
+      free(newMap);
+      free(newData);
+    }
+  }
 
   compute_time += duration_cast<dsec>(Clock::now() - compute_start).count();
   printf("Computation Time: %.4f seconds.\n", compute_time);
@@ -148,9 +336,19 @@ int main(int argc, const char *argv[]) {
   // save result to file
   char* cleanFileName = getOutputFileName(inputFile);
   saveData(cleanFileName, dimReducedData, dataN, reducedDim, numThreads);
+  for (int s = 1; s < numSeeds; s++) {
+    char* seedFileName = (char*) malloc(strlen(cleanFileName) + 16);
+    sprintf(seedFileName, "%s_s%d", cleanFileName, randSeed + s);
+    saveData(seedFileName, dimReducedData + s * mapSize, dataN, reducedDim, numThreads);
+    free(seedFileName);
+  }
   free(cleanFileName);
 
   // Clean up the memory
-  free(data); data = NULL;
+  if (mapping != NULL) munmap(mapping, mappingSize);
+  else free(data);
+  data = NULL;
+  delete stream;
+  delete resumed;
   free(dimReducedData); dimReducedData = NULL;
 }
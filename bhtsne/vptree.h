@@ -9,131 +9,141 @@
  */
 
 
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
+#include <cfloat>
 #include <algorithm>
 #include <vector>
 #include <cstdio>
-#include <queue>
 #include <limits>
+#include <stdint.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "distance.h"
 
 
 #ifndef VPTREE_H
 #define VPTREE_H
 
-class DataPoint
+/*
+    Vantage-point tree over the rows of an [N, D] matrix, stored flat in depth-first order.
+
+    The node of a range of points [lower, upper) is row lower: its vantage point, the points closer to it
+    than the threshold in [lower + 1, right) and the others in [right, upper). So the inside child of
+    row r is row r + 1, and a subtree is a contiguous block of rows. Every row holds a copy of the
+    coordinates of its vantage point, zero padded to paddedDims(D) floats and 64-byte aligned for the
+    distance kernels, followed by the node, so a search step reads one contiguous row, and spatially
+    close points are close in memory.
+
+    Distances are squared Euclidean distances, but node thresholds are not squared: the search prunes
+    children by the triangle inequality, which only holds for the distance itself. Searches give the
+    distance kernel a bound past which the exact distance to a node would not change what is done there,
+    so most distances are abandoned early.
+*/
+class VpTree
 {
-    int _D;
-    int _ind;
-
 public:
-    float* _x;
-    DataPoint() {
-        _D = 1;
-        _ind = -1;
-        _x = NULL;
-    }
-    DataPoint(int D, int ind, float* x) {
-        _D = D;
-        _ind = ind;
-        _x = x;
-    }
-    DataPoint(const DataPoint& other) {                     // this makes a deep copy -- should not free anything
-        if (this != &other) {
-            _D = other.dimensionality();
-            _ind = other.index();
-            _x = other._x;
-        }
+    VpTree() : N(0), D(0), padded_D(0), row_size(0), rows(NULL), build_seed(0), build_points(NULL) {
+        distance = selectDistanceKernel();
     }
 
-    DataPoint& operator= (const DataPoint& other) {         // asignment should free old object
-        if (this != &other) {
-            _D = other.dimensionality();
-            _ind = other.index();
-            _x = other._x;
-        }
-        return *this;
+    ~VpTree() {
+        free(rows);
     }
-    int index() const { return _ind; }
-    int dimensionality() const { return _D; }
-    float x(int d) const { return _x[d]; }
-};
 
-float euclidean_distance_squared(const DataPoint &t1, const DataPoint &t2) {
-    float dd = .0;
-    for (int d = 0; d < t1.dimensionality(); d++) {
-        float t = (t1.x(d) - t2.x(d));
-        dd += t * t;
+    // Function to create a new VpTree from data (in parallel; the seed picks the vantage points)
+    void create(const float* X, int inp_N, int inp_D, unsigned int seed = 0) {
+        N = inp_N;
+        D = inp_D;
+        padded_D = paddedDims(D);
+        row_size = (padded_D * sizeof(float) + sizeof(Node) + 63) / 64 * 64;
+        free(rows);
+        rows = NULL;
+        void* ptr;
+        if (posix_memalign(&ptr, 64, (size_t) N * row_size) != 0) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+        rows = (char*) ptr;
+        buildFromPoints(X, seed);
     }
-    return dd;
-}
 
-template<typename T, float (*distance)( const DataPoint&, const DataPoint&)>
-class VpTree
-{
-public:
-    // Default constructor
-    VpTree() : _root(0) {}
+    // Number of rows, and the coordinates (padded) and index in X of the point of row r. Queries for all
+    // points are best made in row order, which keeps consecutive searches in the same part of the tree.
+    int size() const { return N; }
+    const float* coordinates(int r) const { return reinterpret_cast<const float*>(rows + (size_t) r * row_size); }
+    int index(int r) const { return node(r)->index; }
 
-    // Destructor
-    ~VpTree() {
-        delete _root;
-    }
+    class SearchHeap;
 
-    // Function to create a new VpTree from data
-    void create(const std::vector<T>& items) {
-        delete _root;
-        _items = items;
-        _root = buildFromPoints(0, items.size());
+    // Function that uses the tree to find the k nearest neighbors of target, which must be padded and
+    // aligned as the rows are
+    void search(const float* target, int k, std::vector<int>* indices, std::vector<float>* distances) const
+    {
+        SearchHeap heap;
+        search(target, -1, k, heap);
+        indices->resize(heap.count);
+        distances->resize(heap.count);
+        for (int j = 0; j < heap.count; j++) {
+            (*indices)[j] = index(heap.items[j].index);
+            (*distances)[j] = heap.items[j].dist;
+        }
     }
 
-    // Function that uses the tree to find the k nearest neighbors of target
-    void search(const T& target, int k, std::vector<T>* results, std::vector<float>* distances)
+    // The same, writing the neighbours to indices[j] and their squared distances to distances[j], with a
+    // heap as below
+    void search(const float* target, int k, int* indices, float* distances, SearchHeap& heap) const
     {
-
-        // Use a priority queue to store intermediate results on
-        std::priority_queue<HeapItem> heap;
-
-        // Variable that tracks the distance to the farthest point in our results
-        float tau = DBL_MAX;
-
-        // Perform the search
-        search(_root, target, k, heap, tau);
-
-        // Gather final results
-        results->clear(); distances->clear();
-        while (!heap.empty()) {
-            results->push_back(_items[heap.top().index]);
-            distances->push_back(heap.top().dist);
-            heap.pop();
+        search(target, -1, k, heap);
+        for (int j = 0; j < heap.count; j++) {
+            indices[j] = index(heap.items[j].index);
+            distances[j] = heap.items[j].dist;
         }
+    }
 
-        // Results are in reverse order
-        std::reverse(results->begin(), results->end());
-        std::reverse(distances->begin(), distances->end());
+    // Find the k nearest neighbours of the points of rows [first, last), excluding the points themselves,
+    // and write them by point, sorted by increasing distance: those of the point of row r go to
+    // indices[index(r) * k + j] and their squared distances to distances[index(r) * k + j]. The heap is
+    // scratch space that keeps its storage, so a thread can use one for all its queries (k must be below N).
+    void search(int first, int last, int k, int* indices, float* distances, SearchHeap& heap) const
+    {
+        for (int r = first; r < last; r++) {
+            search(coordinates(r), r, k, heap);
+            size_t out = (size_t) index(r) * k;
+            for (int j = 0; j < heap.count; j++) {
+                indices[out + j] = index(heap.items[j].index);
+                distances[out + j] = heap.items[j].dist;
+            }
+        }
     }
 
 private:
-    std::vector<T> _items;
-
-    // Single node of a VP tree (has a point and radius; left children are closer to point than the radius)
+    // Node of a VP tree, after the coordinates in its row (the node of row r covers rows [r, end))
     struct Node
     {
-        int index;              // index of point in node
-        float threshold;       // radius(?)
-        Node* left;             // points closer by than threshold
-        Node* right;            // points farther away than threshold
+        int index;              // index of the vantage point in X
+        float threshold;        // distance (not squared) to the median point
+        int right;              // first row of the points farther away than threshold
+        int end;
+    };
 
-        Node() :
-            index(0), threshold(0.), left(0), right(0) {}
+    int N;
+    int D;
+    int padded_D;
+    size_t row_size;            // bytes per row: coordinates and node, in multiples of 64
+    char* rows;
+    DistanceKernel distance;
 
-        ~Node() {               // destructor
-            delete left;
-            delete right;
-        }
-    }* _root;
+    VpTree(const VpTree&);
+    VpTree& operator= (const VpTree&);
 
+    float* writableCoordinates(int r) { return reinterpret_cast<float*>(rows + (size_t) r * row_size); }
+    Node* node(int r) { return reinterpret_cast<Node*>(rows + (size_t) r * row_size + padded_D * sizeof(float)); }
+    const Node* node(int r) const { return reinterpret_cast<const Node*>(rows + (size_t) r * row_size + padded_D * sizeof(float)); }
 
-    // An item on the intermediate result queue
+    // An item on the intermediate result queue (and, while building, a point with its distance to the
+    // vantage point)
     struct HeapItem {
         HeapItem( int index, float dist) :
             index(index), dist(dist) {}
@@ -144,92 +154,350 @@ private:
         }
     };
 
-    // Distance comparator for use in std::nth_element
-    struct DistanceComparator
+public:
+    // Results of a search: a max-heap on distance of at most k rows, whose storage is kept from one search
+    // to the next
+    class SearchHeap
     {
-        const T& item;
-        explicit DistanceComparator(const T& item) : item(item) {}
-        bool operator()(const T& a, const T& b) {
-            return distance(item, a) < distance(item, b);
+    public:
+        SearchHeap() : k(0), count(0) {}
+
+    private:
+        friend class VpTree;
+        std::vector<HeapItem> items;
+        int k;
+        int count;
+
+        void reset(int inp_k) {
+            k = inp_k;
+            count = 0;
+            if ((int) items.size() < k) items.resize(k, HeapItem(0, .0));
+        }
+
+        // Add an item, dropping the farthest if there are k (the same steps as a std::priority_queue)
+        void push(const HeapItem& item) {
+            if (count == k) std::pop_heap(items.begin(), items.begin() + count--);
+            items[count++] = item;
+            std::push_heap(items.begin(), items.begin() + count);
         }
     };
 
-    // Function that (recursively) fills the tree
-    Node* buildFromPoints( int lower, int upper )
+private:
+
+    // Ranges of at least PARALLEL_BUILD_SIZE points are split a level at a time, all threads working on one
+    // range while there are few; smaller ranges are built as whole subtrees, one per thread at a time.
+    // Ranges of at least PARALLEL_SELECT_SIZE points are partitioned in blocks of PARTITION_BLOCK items.
+    static const int PARALLEL_BUILD_SIZE = 8192;
+    static const int PARALLEL_SELECT_SIZE = 65536;
+    static const int PARTITION_BLOCK = 4096;
+
+    // Build state: the points padded in their original order, the items being partitioned, and the nodes
+    // by row
+    uint64_t build_seed;
+    float* build_points;
+    std::vector<HeapItem> build_items;
+    std::vector<HeapItem> build_scratch;
+    std::vector<Node> build_nodes;
+
+    // Pseudo-random number for a range (by its first row) and a draw, derived from the seed alone
+    // (splitmix64), so that the tree does not depend on the order in which ranges are split
+    static uint64_t mix(uint64_t z) {
+        z += 0x9E3779B97F4A7C15ULL;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    uint64_t random(int lower, int draw) const { return mix(mix(build_seed + lower) + draw); }
+
+    const float* buildPoint(int index) const { return build_points + (size_t) index * padded_D; }
+
+    // Function that fills the tree. Every range is split the same way, whichever thread splits it and
+    // whether other threads help, so a seed always gives the same tree.
+    void buildFromPoints(const float* X, unsigned int seed)
     {
-        if (upper == lower) {     // indicates that we're done here!
-            return NULL;
+        build_seed = seed;
+        void* ptr;
+        if (posix_memalign(&ptr, 64, (size_t) N * padded_D * sizeof(float)) != 0) { fprintf(stderr, "Memory allocation failed!\n"); exit(1); }
+        build_points = (float*) ptr;
+        build_items.assign(N, HeapItem(0, .0));
+        build_scratch.assign(N, HeapItem(0, .0));
+        build_nodes.resize(N);
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (int n = 0; n < N; n++) {
+            float* x = build_points + (size_t) n * padded_D;
+            memcpy(x, X + (size_t) n * D, D * sizeof(float));
+            for (int d = D; d < padded_D; d++) {
+                x[d] = .0;
+            }
+            build_items[n] = HeapItem(n, .0);
         }
 
+#ifdef _OPENMP
+        int max_threads = omp_get_max_threads();
+#else
+        int max_threads = 1;
+#endif
+
+        // Split the large ranges a level at a time
+        std::vector<std::pair<int, int> > level, subtrees;
+        if (N >= PARALLEL_BUILD_SIZE) {
+            level.push_back(std::make_pair(0, N));
+        }
+        else if (N > 0) {
+            subtrees.push_back(std::make_pair(0, N));
+        }
+        while (!level.empty()) {
+            int num_ranges = level.size();
+            std::vector<int> median(num_ranges);
+            if (num_ranges >= max_threads) {
+#ifdef _OPENMP
+                #pragma omp parallel for schedule(dynamic, 1)
+#endif
+                for (int i = 0; i < num_ranges; i++) {
+                    median[i] = splitRange(level[i].first, level[i].second, false);
+                }
+            }
+            else {
+                for (int i = 0; i < num_ranges; i++) {
+                    median[i] = splitRange(level[i].first, level[i].second, true);
+                }
+            }
+
+            std::vector<std::pair<int, int> > next;
+            for (int i = 0; i < num_ranges; i++) {
+                std::pair<int, int> children[2] = { std::make_pair(level[i].first + 1, median[i]),
+                                                    std::make_pair(median[i], level[i].second) };
+                for (int c = 0; c < 2; c++) {
+                    int size = children[c].second - children[c].first;
+                    if (size >= PARALLEL_BUILD_SIZE) next.push_back(children[c]);
+                    else if (size > 0) subtrees.push_back(children[c]);
+                }
+            }
+            level.swap(next);
+        }
+
+        // Build the small ranges as whole subtrees
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 1)
+#endif
+        for (int i = 0; i < (int) subtrees.size(); i++) {
+            buildSubtree(subtrees[i].first, subtrees[i].second);
+        }
+
+        // Copy the points into tree order
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (int r = 0; r < N; r++) {
+            memcpy(writableCoordinates(r), buildPoint(build_items[r].index), padded_D * sizeof(float));
+            build_nodes[r].index = build_items[r].index;
+            *node(r) = build_nodes[r];
+        }
+
+        free(build_points); build_points = NULL;
+        std::vector<HeapItem>().swap(build_items);
+        std::vector<HeapItem>().swap(build_scratch);
+        std::vector<Node>().swap(build_nodes);
+    }
+
+    // Build the subtree of a range on one thread, with an explicit stack of ranges still to be split (in
+    // depth-first order, inside child first)
+    void buildSubtree(int first, int last)
+    {
+        std::vector<std::pair<int, int> > stack;
+        stack.push_back(std::make_pair(first, last));
+        while (!stack.empty()) {
+            int lower = stack.back().first;
+            int upper = stack.back().second;
+            stack.pop_back();
+
+            int median = splitRange(lower, upper, false);
+            if (median < upper) {
+                stack.push_back(std::make_pair(median, upper));
+            }
+            if (median > lower + 1) {
+                stack.push_back(std::make_pair(lower + 1, median));
+            }
+        }
+    }
+
+    // Make row lower the node of the points in [lower, upper): choose its vantage point and partition the
+    // others around their median distance to it. Returns the first row of the outside child (upper for a
+    // leaf). With parallel, the threads of the calling thread's team share the work.
+    int splitRange(int lower, int upper, bool parallel)
+    {
         // Lower index is center of current node
-        Node* node = new Node();
-        node->index = lower;
+        Node* n = &build_nodes[lower];
+        n->threshold = .0;
+        n->right = upper;
+        n->end = upper;
+        if (upper - lower <= 1) {      // indicates that we're done here!
+            return upper;
+        }
 
-        if (upper - lower > 1) {      // if we did not arrive at leaf yet
+        // Choose an arbitrary point and move it to the start
+        std::vector<HeapItem>& items = build_items;
+        int i = lower + (int) (random(lower, 0) % (uint64_t) (upper - lower));
+        std::swap(items[lower], items[i]);
 
-            // Choose an arbitrary point and move it to the start
-            int i = (int) ((float)rand() / RAND_MAX * (upper - lower - 1)) + lower;
-            std::swap(_items[lower], _items[i]);
+        // Partition around the median distance
+        const float* vantage = buildPoint(items[lower].index);
+        if (parallel) {
+#ifdef _OPENMP
+            #pragma omp parallel for
+#endif
+            for (int j = lower + 1; j < upper; j++) {
+                items[j].dist = distance(vantage, buildPoint(items[j].index), padded_D, FLT_MAX);
+            }
+        }
+        else {
+            for (int j = lower + 1; j < upper; j++) {
+                items[j].dist = distance(vantage, buildPoint(items[j].index), padded_D, FLT_MAX);
+            }
+        }
+        int median = (upper + lower) / 2;
+        select(lower, lower + 1, upper, median, parallel);
 
-            // Partition around the median distance
-            int median = (upper + lower) / 2;
-            std::nth_element(_items.begin() + lower + 1,
-                             _items.begin() + median,
-                             _items.begin() + upper,
-                             DistanceComparator(_items[lower]));
+        // Threshold of the new node will be the distance to the median
+        n->threshold = sqrtf(items[median].dist);
+        n->right = median;
+        return median;
+    }
 
-            // Threshold of the new node will be the distance to the median
-            node->threshold = distance(_items[lower], _items[median]);
+    // Rearrange items[lo, hi) so that items[k] is the one that would be there if they were sorted by distance,
+    // with no larger ones before it and no smaller ones after it. Large ranges are first narrowed down with
+    // three-way partitions around pseudo-random pivots, done in blocks (through build_scratch) so that the
+    // threads can share them; std::nth_element finishes.
+    void select(int lower, int lo, int hi, int k, bool parallel)
+    {
+        std::vector<HeapItem>& items = build_items;
+        std::vector<HeapItem>& scratch = build_scratch;
+        for (int round = 0; hi - lo >= PARALLEL_SELECT_SIZE; round++) {
+
+            // Median of three pivots
+            int size = hi - lo;
+            float a = items[lo + random(lower, 3 * round + 1) % size].dist;
+            float b = items[lo + random(lower, 3 * round + 2) % size].dist;
+            float c = items[lo + random(lower, 3 * round + 3) % size].dist;
+            float pivot = std::max(std::min(a, b), std::min(std::max(a, b), c));
+
+            // Count the items below, at and above the pivot per block, and place the blocks' items in that
+            // order, keeping the order within a block
+            int num_blocks = (size + PARTITION_BLOCK - 1) / PARTITION_BLOCK;
+            std::vector<int> offset(3 * num_blocks, 0);
+#ifdef _OPENMP
+            #pragma omp parallel for if (parallel)
+#endif
+            for (int blk = 0; blk < num_blocks; blk++) {
+                int end = std::min(hi, lo + (blk + 1) * PARTITION_BLOCK);
+                for (int j = lo + blk * PARTITION_BLOCK; j < end; j++) {
+                    offset[3 * blk + (items[j].dist < pivot ? 0 : (items[j].dist == pivot ? 1 : 2))]++;
+                }
+            }
+            int total[3] = { 0, 0, 0 };
+            for (int blk = 0; blk < num_blocks; blk++) {
+                for (int part = 0; part < 3; part++) {
+                    int count = offset[3 * blk + part];
+                    offset[3 * blk + part] = total[part];
+                    total[part] += count;
+                }
+            }
+            int start[3] = { lo, lo + total[0], lo + total[0] + total[1] };
+#ifdef _OPENMP
+            #pragma omp parallel for if (parallel)
+#endif
+            for (int blk = 0; blk < num_blocks; blk++) {
+                int next[3];
+                for (int part = 0; part < 3; part++) {
+                    next[part] = start[part] + offset[3 * blk + part];
+                }
+                int end = std::min(hi, lo + (blk + 1) * PARTITION_BLOCK);
+                for (int j = lo + blk * PARTITION_BLOCK; j < end; j++) {
+                    int part = items[j].dist < pivot ? 0 : (items[j].dist == pivot ? 1 : 2);
+                    scratch[next[part]++] = items[j];
+                }
+            }
+#ifdef _OPENMP
+            #pragma omp parallel for if (parallel)
+#endif
+            for (int j = lo; j < hi; j++) {
+                items[j] = scratch[j];
+            }
 
-            // Recursively build tree
-            node->index = lower;
-            node->left = buildFromPoints(lower + 1, median);
-            node->right = buildFromPoints(median, upper);
+            // Continue in the part that holds k
+            if (k < start[1]) hi = start[1];
+            else if (k < start[2]) return;
+            else lo = start[2];
         }
+        std::nth_element(items.begin() + lo, items.begin() + k, items.begin() + hi);
+    }
+
+    // Search the whole tree for the k nearest neighbours of target other than row skip, leaving them in
+    // heap sorted by increasing distance
+    void search(const float* target, int skip, int k, SearchHeap& heap) const
+    {
+        heap.reset(k);
 
-        // Return result
-        return node;
+        // Variable that tracks the distance to the farthest point in our results
+        float tau = FLT_MAX;
+
+        // Perform the search
+        if (N > 0) {
+            search(0, target, skip, heap, tau);
+        }
+        std::sort_heap(heap.items.begin(), heap.items.begin() + heap.count);
     }
 
-    // Helper function that searches the tree
+    // Helper function that searches the subtree of row r (heap holds rows)
     // [YY]: only modified `heap` and `tau`; seems impossible to parallelize
-    void search(const Node* node, const T& target, unsigned int k, std::priority_queue<HeapItem>& heap, float& tau)
+    void search(int r, const float* target, int skip, SearchHeap& heap, float& tau) const
     {
-        if (node == NULL) return;    // indicates that we're done here
-
-        // Compute distance between target and current node
-        float dist = distance(_items[node->index], target);
+        const Node* n = node(r);
+        bool has_inside = n->right > r + 1;
+        bool has_outside = n->end > n->right;
+
+        // Compute distance between target and current node, up to where it would matter: beyond tau it is
+        // no result, beyond (threshold + sqrt(tau))^2 the inside child is skipped, and beyond
+        // (threshold - sqrt(tau))^2 the outside child is searched. (The children are chosen by the triangle
+        // inequality, which holds for the Euclidean distance and not for its square.)
+        float radius = sqrtf(tau);
+        float bound = tau;
+        if (has_inside) bound = (n->threshold + radius) * (n->threshold + radius);
+        else if (has_outside && n->threshold > radius) bound = std::max(tau, (n->threshold - radius) * (n->threshold - radius));
+        float dist = distance(coordinates(r), target, padded_D, bound);
 
         // If current node within radius tau
-        if (dist < tau) {
-            if (heap.size() == k) heap.pop();                // remove furthest node from result list (if we already have k results)
-            heap.push(HeapItem(node->index, dist));           // add current node to result list
-            if (heap.size() == k) tau = heap.top().dist;    // update value of tau (farthest point in result list)
+        if (dist < tau && r != skip) {
+            heap.push(HeapItem(r, dist));                           // add current node to result list (dropping the furthest if we already have k results)
+            if (heap.count == heap.k) tau = heap.items[0].dist;     // update value of tau (farthest point in result list)
         }
 
         // Return if we arrived at a leaf
-        if (node->left == NULL && node->right == NULL) {
+        if (!has_inside && !has_outside) {
             return;
         }
 
         // If the target lies within the radius of ball
-        if (dist < node->threshold) {
-            if (dist - tau <= node->threshold) {        // if there can still be neighbors inside the ball, recursively search left child first
-                search(node->left, target, k, heap, tau);
+        float target_dist = sqrtf(dist);
+        if (target_dist < n->threshold) {
+            if (has_inside && target_dist - sqrtf(tau) <= n->threshold) {   // if there can still be neighbors inside the ball, recursively search left child first
+                search(r + 1, target, skip, heap, tau);
             }
 
-            if (dist + tau >= node->threshold) {        // if there can still be neighbors outside the ball, recursively search right child
-                search(node->right, target, k, heap, tau);
+            if (has_outside && target_dist + sqrtf(tau) >= n->threshold) {  // if there can still be neighbors outside the ball, recursively search right child
+                search(n->right, target, skip, heap, tau);
             }
 
             // If the target lies outsize the radius of the ball
         } else {
-            if (dist + tau >= node->threshold) {        // if there can still be neighbors outside the ball, recursively search right child first
-                search(node->right, target, k, heap, tau);
+            if (has_outside && target_dist + sqrtf(tau) >= n->threshold) {  // if there can still be neighbors outside the ball, recursively search right child first
+                search(n->right, target, skip, heap, tau);
             }
 
-            if (dist - tau <= node->threshold) {         // if there can still be neighbors inside the ball, recursively search left child
-                search(node->left, target, k, heap, tau);
+            if (has_inside && target_dist - sqrtf(tau) <= n->threshold) {   // if there can still be neighbors inside the ball, recursively search left child
+                search(r + 1, target, skip, heap, tau);
             }
         }
     }